@@ -1,4 +1,33 @@
+#define _GNU_SOURCE // POLLRDHUP
 #include "RUDP.h"
+#include "RUDP_Uring.h"
+#include <poll.h>
+
+static int stats_sendto(RUDP_Socket *sockfd, const void *buffer, size_t length, const struct sockaddr_in *addr);
+static int stats_recvfrom(RUDP_Socket *sockfd, void *buffer, size_t length, struct sockaddr_in *addr);
+static void stats_histogram(atomic_ullong *histogram, unsigned long long us);
+static void stats_count(atomic_ullong *counter, unsigned long long n);
+static void* stats_dump_thread(void *arg);
+static void stats_dump_stop(RUDP_Socket *sockfd);
+static unsigned long long now_us(void);
+static RUDP_Fec* fec_alloc(RUDP_Socket *sockfd);
+static int fec_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
+static int fec_receive(RUDP_Socket *sockfd, RUDPPacket *packet, unsigned int num_bytes);
+static int fec_probe(RUDP_Socket *sockfd);
+static bool fec_deliver(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size, int *result);
+static int handshake(RUDP_Socket *sockfd, const struct sockaddr_in *server_addr, RUDPPacket *SYN_packet, unsigned int syn_size);
+static unsigned int session_ticket(RUDP_Socket *sockfd, const struct sockaddr_in *addr);
+static int deliver_packet(RUDPPacket *packet, void *buffer, unsigned int buffer_size);
+static int fec_flush(RUDP_Socket *sockfd);
+static unsigned int fec_covered(unsigned int length);
+static int msg_flush(RUDP_Socket *sockfd);
+static int msg_deliver(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
+static unsigned int socket_buffer(int fd, int option, int force_option, unsigned int bytes);
+static void socket_autotune(RUDP_Socket *sockfd, unsigned long long rtt_us, unsigned long long bytes, unsigned long long elapsed_us);
+static unsigned short receive_window(RUDP_Socket *sockfd);
+static int socket_recvfrom(RUDP_Socket *sockfd, void *buffer, size_t length, struct sockaddr_in *addr);
+static int batch_sendto(RUDP_Socket *sockfd, const void *buffer, size_t length);
+static int batch_flush(RUDP_Socket *sockfd);
 
 /**
  * Allocates and Creates a new RUDP socket.
@@ -11,13 +40,13 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port){
 
     RUDP_Socket* sock = (RUDP_Socket*)malloc(sizeof(RUDP_Socket));
     if(sock == NULL){
-        perror("Error in RUDP socket allocation\n");
+        rudp_log_error("Error in RUDP socket allocation: %s", strerror(errno));
         return NULL;
     }
 
     sock->socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if(sock->socket_fd == -1){
-        perror("Error creating UDP socket\n");
+        rudp_log_error("Error creating UDP socket: %s", strerror(errno));
         free(sock);
         return NULL;
     }
@@ -26,6 +55,36 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port){
     memset(&(sock->dest_addr), 0, sizeof(struct sockaddr_in)); // Initialize destination address structure
     sock->isServer = isServer; // Set state based on the isServer parameter
     sock->isConnected = false; // Set initial connection state
+    sock->fec = NULL; // FEC is off until rudp_set_fec() or the first FEC segment
+    sock->rto_us = 0; // Receives block until a timeout is set below
+    sock->srtt_us = 0;
+    sock->delivery_rate = 0;
+    memset(&sock->stats, 0, sizeof(sock->stats));
+    sock->stats_out = NULL;
+    sock->stats_interval_ms = 0;
+    sock->stats_dumping = false;
+    atomic_init(&sock->stats_stop, false);
+    sock->ticket_secret = 0;
+    sock->rejected_ticket = 0;
+    sock->rejected_at_us = 0;
+    sock->ticket = 0;
+    memset(&sock->ticket_addr, 0, sizeof(sock->ticket_addr));
+    sock->resume_pending = false;
+    sock->early_data = NULL;
+    sock->msg_out = NULL;
+    sock->msg_out_length = 0;
+    sock->msg_out_since = 0;
+    sock->msg_delay_us = RUDP_MSG_DELAY_US;
+    sock->msg_in = NULL;
+    sock->msg_in_offset = 0;
+    sock->uring = NULL;
+    sock->read_pending = false;
+    sock->read_result = 0;
+
+    // The kernel defaults hold less than one full FEC block, which would be dropped on any burst.
+    // Both buffers start with room for a block and its parity and grow from there.
+    sock->rcvbuf = socket_buffer(sock->socket_fd, SO_RCVBUF, SO_RCVBUFFORCE, (RUDP_FEC_MAX_K + 1) * RUDP_PACKET_TRUESIZE);
+    sock->sndbuf = socket_buffer(sock->socket_fd, SO_SNDBUF, SO_SNDBUFFORCE, (RUDP_FEC_MAX_K + 1) * RUDP_PACKET_TRUESIZE);
 
     //Initialize a server
     if(isServer){
@@ -36,11 +95,16 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port){
         server_addr.sin_port = htons(listen_port);
 
         if(bind(sock->socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1){
-            perror("Error binding UDP socket");
+            rudp_log_error("Error binding UDP socket: %s", strerror(errno));
             close(sock->socket_fd);
             free(sock);
             return NULL;
         }
+
+        // Key of the session tickets, a restarted receiver rejects the old ones
+        if(getrandom(&sock->ticket_secret, sizeof(sock->ticket_secret), 0) != sizeof(sock->ticket_secret)){
+            sock->ticket_secret = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+        }
     }
     else{
         struct timeval timeout;
@@ -48,7 +112,19 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port){
         timeout.tv_usec = 1000;
 
         setsockopt(sock->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        sock->rto_us = timeout.tv_sec * 1000000 + timeout.tv_usec;
+    }
+
+#ifdef RUDP_IO_URING
+    // The server receives through the ring. The client only sends and reads files through it,
+    // it waits for ACKs with a timeout, which a blocking recvfrom() already gives.
+    sock->uring = (RUDP_Uring*)malloc(sizeof(RUDP_Uring));
+    if(sock->uring != NULL && rudp_uring_init(sock->uring, isServer) == 0){
+        rudp_log_warn("io_uring is not available, using blocking I/O");
+        free(sock->uring);
+        sock->uring = NULL;
     }
+#endif
 
     return sock;
 }
@@ -62,128 +138,201 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port){
  * @return 1 if the connection is successful, 0 if an error occurs.
  */
 int rudp_connect(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port){
+    return rudp_connect_data(sockfd, dest_ip, dest_port, NULL, 0);
+}
+
+/**
+ * Initiates a connection to a remote RUDP socket, sending the first DATA packet with the connection request.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param dest_ip IP address of the remote socket.
+ * @param dest_port Port of the remote socket.
+ * @param buffer DATA packet to send, NULL to connect without data.
+ * @param buffer_size Size of the data to send.
+ * @return 1 if the connection is successful and the data acknowledged, 0 if an error occurs.
+ */
+int rudp_connect_data(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port, void *buffer, unsigned int buffer_size){
 
-    if (sockfd == NULL || dest_ip == NULL || sockfd->isConnected || sockfd->isServer) {
+    if (sockfd == NULL || dest_ip == NULL || sockfd->isConnected || sockfd->isServer ||
+        (buffer != NULL && (buffer_size < sizeof(RUDPHeader) || buffer_size > sizeof(RUDPPacket)))) {
         return 0;  // Failure
     }
 
-    struct sockaddr_in server_addr, recv_addr;
-    socklen_t recv_addrlen;
+    struct sockaddr_in server_addr;
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(dest_port);
 
     if(inet_aton(dest_ip, &server_addr.sin_addr) == 0){
-        perror("Invalid destination IP\n");
+        rudp_log_error("Invalid destination IP");
         return 0;  // Failure
     }
 
+    // Resume a known session without a handshake. FEC blocks are not acknowledged
+    // packet by packet, so they always start with a handshake.
+    if(sockfd->ticket != 0 && sockfd->fec == NULL &&
+       sockfd->ticket_addr.sin_addr.s_addr == server_addr.sin_addr.s_addr &&
+       sockfd->ticket_addr.sin_port == server_addr.sin_port){
+
+        sockfd->dest_addr = server_addr;
+        sockfd->isConnected = true;
+        sockfd->resume_pending = true;
+
+        if(buffer != NULL && rudp_send(sockfd, buffer, buffer_size) == -1){
+            sockfd->isConnected = false;
+            sockfd->resume_pending = false;
+            return 0;
+        }
+        return 1;
+    }
+
     RUDPPacket SYN_packet;
-    memset(SYN_packet.data, 0, BUFFER_SIZE);
-    SYN_packet.header.length = 0;
-    SYN_packet.header.checksum = 0;
+    memset(&SYN_packet, 0, sizeof(SYN_packet));
+    if(buffer != NULL){
+        memcpy(&SYN_packet, buffer, buffer_size);
+        SYN_packet.header.flags = RUDP_SYN | RUDP_DATA;
+        return handshake(sockfd, &server_addr, &SYN_packet, buffer_size);
+    }
     SYN_packet.header.flags = RUDP_SYN;
+    return handshake(sockfd, &server_addr, &SYN_packet, sizeof(SYN_packet));
+}
 
-    while(1){
-        if(sendto(sockfd->socket_fd, &SYN_packet, sizeof(SYN_packet), 0,
-                  (struct sockaddr*) &server_addr, sizeof(server_addr))  == -1){
+/**
+ * Accepts an incoming connection request on a server RUDP socket.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @return 1 if the connection is accepted, 0 if an error occurs.
+ */
+int rudp_accept(RUDP_Socket *sockfd){
 
-            perror("Error sending SYN Packet\n");
-            return 0;  // Failure
-        }
+    if (sockfd == NULL || sockfd->isConnected || !(sockfd->isServer)) {
+        return 0;  // Failure
+    }
 
-        RUDPPacket answer;
-        recv_addrlen = sizeof(recv_addr);
-        int num_bytes = recvfrom(sockfd->socket_fd, &answer, sizeof(answer), 0,
-                                 (struct sockaddr*) &(recv_addr), &recv_addrlen);
-        if(num_bytes == -1){
+    RUDPPacket packet;
 
-            if(errno == EWOULDBLOCK || errno == EAGAIN){
-                printf("Timeout occurred, sending connect request again\n");
-                continue;
-            }
-            else{
-                perror("Receive failed\n");
+    while(1){
+        int num_bytes = stats_recvfrom(sockfd, &packet, sizeof(packet), &sockfd->dest_addr);
+        if(num_bytes == -1){
+            // another thread shutting the socket down is how a waiting server is stopped
+            if(errno == ESHUTDOWN){
+                rudp_log_info("Socket shut down, no more connection requests");
                 return 0;
             }
+            rudp_log_error("Error in receiving connection requests: %s", strerror(errno));
+            return 0;
+        }
+
+        bool has_data = packet.header.flags & RUDP_DATA;
+        if(has_data && (packet.header.length > BUFFER_SIZE ||
+                        packet.header.checksum != calculate_checksum(packet.data, packet.header.length))){
+            // the sender retransmits the request
+            stats_count(&sockfd->stats.checksum_failures, 1);
+            continue;
         }
-        else{
 
-            if(memcmp(&recv_addr.sin_addr, &server_addr.sin_addr, sizeof(struct in_addr)) == 0 &&
-                    recv_addr.sin_port == server_addr.sin_port){
+        RUDPHeader ACK_packet;
+        memset(&ACK_packet, 0, sizeof(ACK_packet));
+        ACK_packet.flags = RUDP_ACK;
 
-                if(answer.header.flags == RUDP_ACK){
-                    sockfd->dest_addr.sin_family = AF_INET;
-                    sockfd->dest_addr.sin_port = htons(dest_port);
-                    inet_aton(dest_ip, &(sockfd->dest_addr.sin_addr));
-                    sockfd->isConnected = true;
-                    return 1;
+        if(packet.header.flags == RUDP_SYN || packet.header.flags == (RUDP_SYN | RUDP_DATA)){
+            rudp_log_info("Connection request received, sending ACK");
+            ACK_packet.ticket = session_ticket(sockfd, &sockfd->dest_addr);
+        }
+        else if(has_data && !(packet.header.flags & RUDP_SYN) && packet.header.fec_count == 0 && packet.header.ticket != 0){
+            if(packet.header.ticket != session_ticket(sockfd, &sockfd->dest_addr)){
+                // unknown or old ticket: ask for a full handshake. The client keeps retransmitting
+                // until the SYN reaches it, so the copies in flight are not answered one by one.
+                unsigned long long now = now_us();
+                if(packet.header.ticket == sockfd->rejected_ticket && now - sockfd->rejected_at_us < RUDP_TICKET_REJECT_US){
+                    continue;
                 }
-                else{
-                    perror("Wrong packet received\n");
+                sockfd->rejected_ticket = packet.header.ticket;
+                sockfd->rejected_at_us = now;
+                rudp_log_warn("Invalid session ticket, asking for a handshake");
+                RUDPHeader SYN_request;
+                memset(&SYN_request, 0, sizeof(SYN_request));
+                SYN_request.flags = RUDP_SYN;
+                if(stats_sendto(sockfd, &SYN_request, sizeof(SYN_request), &sockfd->dest_addr) == -1){
+                    rudp_log_error("Error sending SYN request: %s", strerror(errno));
                     return 0;
                 }
+                continue;
             }
-            else{
-                perror("Received a packet from an unexpected source\n");
+            rudp_log_info("Session resumed, sending ACK");
+        }
+        else if(packet.header.flags == RUDP_FIN){
+            // the ACK of the previous connection's FIN was lost, the client is still closing it.
+            // That connection is over, failing to answer is no reason to stop accepting
+            stats_count(&sockfd->stats.duplicates, 1);
+            stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr);
+            continue;
+        }
+        else if(packet.header.flags == RUDP_PARITY || (packet.header.flags == RUDP_DATA && packet.header.fec_count != 0)){
+            // a late or reordered block of the previous connection, its sender has moved on
+            stats_count(&sockfd->stats.duplicates, 1);
+            continue;
+        }
+        else{
+            rudp_log_error("Packet received is not a SYN packet, connection failed");
+            return 0;
+        }
+
+        // a message batch is handed out record by record, like one received later
+        RUDPPacket** stash = packet.header.flags & RUDP_MSG ? &sockfd->msg_in : &sockfd->early_data;
+        if(has_data){
+            *stash = (RUDPPacket*)malloc(sizeof(RUDPPacket));
+            if(*stash == NULL){
+                rudp_log_error("Error in early data allocation: %s", strerror(errno));
                 return 0;
             }
-
-
+            memcpy(*stash, &packet, sizeof(RUDPPacket));
+            sockfd->msg_in_offset = 0;
         }
 
-
+        if(stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr) == -1){
+            rudp_log_error("Error sending ACK packet: %s", strerror(errno));
+            free(*stash);
+            *stash = NULL;
+            return 0;
+        }
+        sockfd->isConnected = true;
+        return 1;
     }
 
 }
 
 /**
- * Accepts an incoming connection request on a server RUDP socket.
+ * Copies the session ticket of a client RUDP socket.
  *
  * @param sockfd Pointer to the RUDP socket.
- * @return 1 if the connection is accepted, 0 if an error occurs.
+ * @param session Filled with the session.
+ * @return 1 on success, 0 if the socket has no ticket.
  */
-int rudp_accept(RUDP_Socket *sockfd){
-
-    if (sockfd == NULL || sockfd->isConnected || !(sockfd->isServer)) {
-        return 0;  // Failure
-    }
-
-    RUDPPacket packet;
-    socklen_t recv_addrlen = sizeof(struct sockaddr_in);
-
-    int num_bytes = recvfrom(sockfd->socket_fd, &packet, sizeof(packet), 0,
-                             (struct sockaddr*) &sockfd->dest_addr, &recv_addrlen);
-    if(num_bytes == -1){
-        perror("Error in receiving connection requests\n");
+int rudp_get_session(RUDP_Socket *sockfd, RUDP_Session *session){
+    if(sockfd == NULL || session == NULL || sockfd->ticket == 0){
         return 0;
     }
-    else{
-        if(packet.header.flags == RUDP_SYN){
-            RUDPHeader ACK_packet;
-            ACK_packet.length = 0;
-            ACK_packet.checksum = 0;
-            ACK_packet.flags = RUDP_ACK;
-
-            printf("Connection request received, sending ACK\n");
+    session->addr = sockfd->ticket_addr;
+    session->ticket = sockfd->ticket;
+    return 1;
+}
 
-            if(sendto(sockfd->socket_fd, &ACK_packet, sizeof(ACK_packet), 0,
-                      (struct sockaddr*) &sockfd->dest_addr, sizeof(sockfd->dest_addr)) == -1){
-                perror("Error sending ACK packet\n");
-                return 0;
-            }
-            else{
-                sockfd->isConnected = true;
-                return 1;
-            }
-        }
-        else{
-            printf("Packet received is not a SYN packet, connection failed\n");
-            return 0;
-        }
+/**
+ * Gives a client RUDP socket a saved session to resume on its next rudp_connect().
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param session Session to resume.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_set_session(RUDP_Socket *sockfd, const RUDP_Session *session){
+    if(sockfd == NULL || session == NULL || sockfd->isServer || sockfd->isConnected){
+        return 0;
     }
-
+    sockfd->ticket_addr = session->addr;
+    sockfd->ticket = session->ticket;
+    return 1;
 }
 
 /**
@@ -202,78 +351,141 @@ int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
 
     RUDPPacket RECV_packet;
     struct sockaddr_in recv_addr;
-    socklen_t recv_addrlen = sizeof(recv_addr);
-    int num_bytes = recvfrom(sockfd->socket_fd,&RECV_packet, sizeof(RECV_packet), 0,
-                             (struct sockaddr*) &recv_addr, &recv_addrlen);
 
-    if(num_bytes == -1){
-        perror("Error on recvfrom failed\n");
+    // A client waiting for data sends what it queued first, the answer may depend on it
+    if(!sockfd->isServer && msg_flush(sockfd) == 0){
         return -1;
     }
-    else{
-        if(memcmp(&recv_addr.sin_addr, &sockfd->dest_addr.sin_addr, sizeof(struct in_addr)) == 0 &&
-           recv_addr.sin_port == sockfd->dest_addr.sin_port){
 
-            RUDPHeader ACK_packet;
-            ACK_packet.length = 0;
-            ACK_packet.checksum = 0;
-            ACK_packet.flags = RUDP_ACK;
+    // DATA that came with the connection request
+    if(sockfd->early_data != NULL){
+        int result = deliver_packet(sockfd->early_data, buffer, buffer_size);
+        free(sockfd->early_data);
+        sockfd->early_data = NULL;
+        return result;
+    }
+
+    // Records of a received message batch
+    if(sockfd->msg_in != NULL){
+        return msg_deliver(sockfd, buffer, buffer_size);
+    }
+
+    while(1){
+        // Segments of a FEC block are handed out in order, one per call
+        int fec_result;
+        if(fec_deliver(sockfd, buffer, buffer_size, &fec_result)){
+            return fec_result;
+        }
 
-            switch(RECV_packet.header.flags){
+        int num_bytes = stats_recvfrom(sockfd, &RECV_packet, sizeof(RECV_packet), &recv_addr);
 
-                case RUDP_SYN:
+        if(num_bytes == -1){
+            if(errno == ESHUTDOWN){
+                rudp_log_info("Socket shut down while receiving");
+                return -1;
+            }
+            rudp_log_error("Error on recvfrom failed: %s", strerror(errno));
+            return -1;
+        }
 
-                    if(sendto(sockfd->socket_fd, &ACK_packet, sizeof(ACK_packet), 0,
-                              (struct sockaddr*) &sockfd->dest_addr, sizeof(sockfd->dest_addr)) == -1){
-                        perror("Error sending ACK packet\n");
-                        return -1;
-                    }
-                    else{
-                        return -2;
-                    }
+        if(memcmp(&recv_addr.sin_addr, &sockfd->dest_addr.sin_addr, sizeof(struct in_addr)) != 0 ||
+           recv_addr.sin_port != sockfd->dest_addr.sin_port){
+            rudp_log_error("Received a packet from an unexpected source");
+            return -1;
+        }
 
-                case RUDP_DATA:
-
-                    if(RECV_packet.header.checksum == calculate_checksum(RECV_packet.data, RECV_packet.header.length)){
-
-                        if(sendto(sockfd->socket_fd, &ACK_packet, sizeof(ACK_packet), 0,
-                                  (struct sockaddr*) &sockfd->dest_addr, sizeof(sockfd->dest_addr)) == -1){
-                            perror("Error sending ACK packet");
-                            return -1;
-                        }
-                        else{
-                            memcpy(buffer, RECV_packet.data, buffer_size);
-                            if(RECV_packet.data[0] == EOF){
-                                return -3;
-                            }
-                            return RECV_packet.header.length;
-                        }
-                    }
-                    else{
-                        perror("Checksum failed\n");
-                        return -1;
-                    }
+        // FEC segments are acknowledged once per block, when its parity arrives
+        if(RECV_packet.header.flags == RUDP_PARITY ||
+           (RECV_packet.header.flags == RUDP_DATA && RECV_packet.header.fec_count != 0)){
+            if(fec_receive(sockfd, &RECV_packet, num_bytes) == -1){
+                return -1;
+            }
+            continue;
+        }
+
+        if((RECV_packet.header.flags & RUDP_DATA) && RECV_packet.header.ticket != 0 &&
+           RECV_packet.header.ticket != session_ticket(sockfd, &sockfd->dest_addr)){
+            // late copy of a resume attempt that was rejected, the client sends it again after its handshake
+            stats_count(&sockfd->stats.duplicates, 1);
+            continue;
+        }
+
+        RUDPHeader ACK_packet;
+        memset(&ACK_packet, 0, sizeof(ACK_packet));
+        ACK_packet.flags = RUDP_ACK;
+
+        switch(RECV_packet.header.flags){
+
+            case RUDP_SYN:
+            case RUDP_SYN | RUDP_DATA:
+
+                // the ACK of the handshake was lost, answer it again with the same ticket
+                stats_count(&sockfd->stats.duplicates, 1);
+                ACK_packet.ticket = session_ticket(sockfd, &sockfd->dest_addr);
+                if(stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr) == -1){
+                    rudp_log_error("Error sending ACK packet: %s", strerror(errno));
+                    return -1;
+                }
+                else{
+                    return -2;
+                }
+
+            case RUDP_DATA:
 
-                case RUDP_FIN:
+                if(RECV_packet.header.checksum == calculate_checksum(RECV_packet.data, RECV_packet.header.length)){
 
-                    if(sendto(sockfd->socket_fd, &ACK_packet, sizeof(ACK_packet), 0,
-                              (struct sockaddr*) &sockfd->dest_addr, sizeof(sockfd->dest_addr)) == -1){
-                        perror("Error sending ACK packet\n");
+                    if(stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr) == -1){
+                        rudp_log_error("Error sending ACK packet: %s", strerror(errno));
                         return -1;
                     }
                     else{
-                        sockfd->isConnected = false;
-                        memset(&sockfd->dest_addr, 0, sizeof(sockfd->dest_addr));
-                        return 0;
+                        return deliver_packet(&RECV_packet, buffer, buffer_size);
                     }
-            }
-        }
-        else{
-            perror("Received a packet from an unexpected source\n");
-            return -1;
+                }
+                else{
+                    rudp_log_error("Checksum failed");
+                    stats_count(&sockfd->stats.checksum_failures, 1);
+                    return -1;
+                }
+
+            case RUDP_DATA | RUDP_MSG:
+
+                if(RECV_packet.header.length > BUFFER_SIZE ||
+                   RECV_packet.header.checksum != calculate_checksum(RECV_packet.data, RECV_packet.header.length)){
+                    rudp_log_error("Checksum failed");
+                    stats_count(&sockfd->stats.checksum_failures, 1);
+                    return -1;
+                }
+                if(stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr) == -1){
+                    rudp_log_error("Error sending ACK packet: %s", strerror(errno));
+                    return -1;
+                }
+
+                sockfd->msg_in = (RUDPPacket*)malloc(sizeof(RUDPPacket));
+                if(sockfd->msg_in == NULL){
+                    rudp_log_error("Error in message batch allocation: %s", strerror(errno));
+                    return -1;
+                }
+                memcpy(sockfd->msg_in, &RECV_packet, sizeof(RUDPHeader) + RECV_packet.header.length);
+                sockfd->msg_in_offset = 0;
+                return msg_deliver(sockfd, buffer, buffer_size);
+
+            case RUDP_FIN:
+
+                if(stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr) == -1){
+                    rudp_log_error("Error sending ACK packet: %s", strerror(errno));
+                    return -1;
+                }
+                else{
+                    sockfd->isConnected = false;
+                    memset(&sockfd->dest_addr, 0, sizeof(sockfd->dest_addr));
+                    free(sockfd->fec);
+                    sockfd->fec = NULL;
+                    return 0;
+                }
         }
+        return -1;
     }
-    return -1;
 
 }
 
@@ -287,35 +499,63 @@ int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
  * @return Number of bytes sent if sent DATA packet, 0 if sent FIN packet, -1 if an error occurs.
  */
 int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
-    if(sockfd == NULL || !sockfd->isConnected  || buffer == NULL || buffer_size <= 0){
+    if(sockfd == NULL || !sockfd->isConnected  || buffer == NULL || buffer_size < sizeof(RUDPHeader)){
         return -1;
     }
 
     RUDPPacket* send_packet = (RUDPPacket*)buffer;
+
+    // Queued messages go first to keep the order
+    if(sockfd->msg_out_length > 0 && send_packet != sockfd->msg_out && msg_flush(sockfd) == 0){
+        return -1;
+    }
+
+    if(sockfd->fec != NULL && send_packet->header.flags == RUDP_DATA){
+        return fec_send(sockfd, buffer, buffer_size);
+    }
+
+    // The first packet of a resumed connection opens it on the receiver side.
+    // The ticket goes on a copy, the caller may send the same buffer on a later connection
+    RUDPPacket resume_packet;
+    if(sockfd->resume_pending){
+        if(buffer_size > sizeof(resume_packet)){
+            buffer_size = sizeof(resume_packet);
+        }
+        memcpy(&resume_packet, buffer, buffer_size);
+        resume_packet.header.ticket = sockfd->ticket;
+        send_packet = &resume_packet;
+    }
+
+    int num_bytes = 0;
+    bool resend = true;
+    bool retransmitted = false;
+    unsigned long long sent_at = now_us();
+    stats_count(&sockfd->stats.window[1], 1);
     while(1){
-        int num_bytes = sendto(sockfd->socket_fd, buffer, buffer_size, 0,
-                           (struct sockaddr*)&sockfd->dest_addr, sizeof(sockfd->dest_addr));
-        if(num_bytes == -1){
-            perror("sendto failed\n");
-            return -1;
+        if(resend){
+            num_bytes = stats_sendto(sockfd, send_packet, buffer_size, &sockfd->dest_addr);
+            if(num_bytes == -1){
+                rudp_log_error("sendto failed: %s", strerror(errno));
+                return -1;
+            }
         }
+        resend = true;
 
         struct sockaddr_in recv_addr;
-        socklen_t recv_addrlen;
-
         RUDPHeader answer;
-        recv_addrlen = sizeof(recv_addr);
 
-        int num_recv_bytes = recvfrom(sockfd->socket_fd, &answer, sizeof(answer), 0,
-                                 (struct sockaddr*) &(recv_addr), &recv_addrlen);
+        int num_recv_bytes = stats_recvfrom(sockfd, &answer, sizeof(answer), &recv_addr);
         if(num_recv_bytes == -1){
 
             if(errno == EWOULDBLOCK || errno == EAGAIN){
-                printf("Timeout occurred, sending data again\n");
+                rudp_log_debug("Timeout occurred, sending data again");
+                stats_count(&sockfd->stats.retransmits, 1);
+                stats_histogram(sockfd->stats.rto_us, sockfd->rto_us);
+                retransmitted = true;
                 continue;
             }
             else{
-                perror("Receive failed\n");
+                rudp_log_error("Receive failed: %s", strerror(errno));
                 return -1;
             }
         }
@@ -323,9 +563,37 @@ int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
             if(memcmp(&recv_addr.sin_addr, &sockfd->dest_addr.sin_addr, sizeof(struct in_addr)) == 0 &&
                recv_addr.sin_port == sockfd->dest_addr.sin_port){
 
+                if(answer.flags == (RUDP_ACK | RUDP_PARITY) || (answer.flags == RUDP_SYN && !sockfd->resume_pending)){
+                    // late ACK of an already finished FEC block, or a late answer to a rejected ticket: keep waiting
+                    resend = false;
+                    continue;
+                }
+                if(answer.flags == RUDP_SYN && sockfd->resume_pending){
+                    // the receiver does not know our ticket, fall back to a full handshake
+                    rudp_log_info("Session ticket rejected, connecting again");
+                    sockfd->resume_pending = false;
+                    sockfd->isConnected = false;
+                    sockfd->ticket = 0;
+                    send_packet->header.ticket = 0;
+
+                    RUDPPacket SYN_packet;
+                    memset(&SYN_packet, 0, sizeof(SYN_packet));
+                    SYN_packet.header.flags = RUDP_SYN;
+                    struct sockaddr_in server_addr = sockfd->dest_addr;
+                    if(handshake(sockfd, &server_addr, &SYN_packet, sizeof(SYN_packet)) == 0){
+                        return -1;
+                    }
+                    continue;
+                }
                 if(answer.flags == RUDP_ACK){
+                    sockfd->resume_pending = false;
 
-                    if(send_packet->header.flags == RUDP_DATA){
+                    if(!retransmitted){
+                        unsigned long long rtt = now_us() - sent_at;
+                        stats_histogram(sockfd->stats.rtt_us, rtt);
+                        socket_autotune(sockfd, rtt, num_bytes, rtt);
+                    }
+                    if(send_packet->header.flags & RUDP_DATA){
                         return num_bytes;
                     }
                     if(send_packet->header.flags == RUDP_FIN){
@@ -333,12 +601,12 @@ int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
                     }
                 }
                 else{
-                    perror("Wrong packet received\n");
+                    rudp_log_error("Wrong packet received");
                     return -1;
                 }
             }
             else{
-                perror("Received a packet from an unexpected source\n");
+                rudp_log_error("Received a packet from an unexpected source");
                 return -1;
             }
         }
@@ -352,65 +620,1096 @@ int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
 
 
 /**
- * Disconnects from a connected RUDP socket.
+ * Enables forward error correction on a client RUDP socket.
  *
  * @param sockfd Pointer to the RUDP socket.
- * @return 1 if disconnection is successful, 0 if an error occurs.
+ * @param max_k Max data segments per block (1 to RUDP_FEC_MAX_K), 0 to turn FEC off.
+ * @return 1 on success, 0 if an error occurs.
  */
-int rudp_disconnect(RUDP_Socket *sockfd){
-
-    if(sockfd == NULL || !sockfd->isConnected){
+int rudp_set_fec(RUDP_Socket *sockfd, unsigned int max_k){
+    if(sockfd == NULL || sockfd->isServer || max_k > RUDP_FEC_MAX_K){
         return 0;
     }
-    RUDPPacket FIN_packet;
-    FIN_packet.header.flags = RUDP_FIN;
-    memset(FIN_packet.data, 0, BUFFER_SIZE);
-    FIN_packet.header.length = 0;
-    FIN_packet.header.checksum = 0;
 
-    if(rudp_send(sockfd, &FIN_packet, sizeof(FIN_packet)) == 0){
-        sockfd->isConnected = false;
-        memset(&sockfd->dest_addr, 0, sizeof(sockfd->dest_addr));
+    if(max_k == 0){
+        // a pending block has to be flushed first
+        if(sockfd->fec != NULL && sockfd->fec->count != 0){
+            return 0;
+        }
+        free(sockfd->fec);
+        sockfd->fec = NULL;
         return 1;
     }
-    return 0;
+
+    RUDP_Fec* fec = fec_alloc(sockfd);
+    if(fec == NULL){
+        return 0;
+    }
+    if(fec->k == 0){
+        // the receiver is assumed to have room until its first ACK tells
+        fec->window = RUDP_FEC_MAX_K;
+    }
+    fec->max_k = max_k;
+    if(fec->k == 0 || fec->k > max_k){
+        fec->k = max_k;
+    }
+    return 1;
 }
 
 /**
- * Closes an RUDP socket.
+ * Sends the pending FEC block parity and the pending small messages, and waits until the receiver has them.
  *
- * @param sockfd Pointer to the RUDP socket to close.
- * @return 0 on success, -1 if an error occurs.
+ * @param sockfd Pointer to the RUDP socket.
+ * @return 1 on success, 0 if an error occurs.
  */
-int rudp_close(RUDP_Socket *sockfd){
-    if(sockfd == NULL){
+int rudp_flush(RUDP_Socket *sockfd){
+    if(sockfd == NULL || !sockfd->isConnected){
+        return 0;
+    }
+    return msg_flush(sockfd);
+}
+
+/**
+ * Queues a small message, sending the batch once it is full or its oldest message waited long enough.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param msg Message to send.
+ * @param length Size of the message, 1 to BUFFER_SIZE - 2 bytes.
+ * @return length on success, -1 if an error occurs.
+ */
+int rudp_send_msg(RUDP_Socket *sockfd, const void *msg, unsigned int length){
+    if(sockfd == NULL || !sockfd->isConnected || msg == NULL || length == 0 ||
+       length > BUFFER_SIZE - sizeof(unsigned short)){
         return -1;
     }
-    close(sockfd->socket_fd);
-    free(sockfd);
-    return 0;
+
+    if(sockfd->msg_out == NULL){
+        sockfd->msg_out = (RUDPPacket*)malloc(sizeof(RUDPPacket));
+        if(sockfd->msg_out == NULL){
+            rudp_log_error("Error in message batch allocation: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    // No room left for this one, send what is queued first
+    if(sockfd->msg_out_length + sizeof(unsigned short) + length > BUFFER_SIZE && msg_flush(sockfd) == 0){
+        return -1;
+    }
+
+    if(sockfd->msg_out_length == 0){
+        sockfd->msg_out_since = now_us();
+    }
+    unsigned short record_length = length;
+    memcpy(sockfd->msg_out->data + sockfd->msg_out_length, &record_length, sizeof(record_length));
+    memcpy(sockfd->msg_out->data + sockfd->msg_out_length + sizeof(record_length), msg, length);
+    sockfd->msg_out_length += sizeof(record_length) + length;
+
+    // Full (no room for even a 1 byte record) or waited long enough
+    if((sockfd->msg_out_length + sizeof(record_length) + 1 > BUFFER_SIZE ||
+        now_us() - sockfd->msg_out_since >= sockfd->msg_delay_us) && msg_flush(sockfd) == 0){
+        return -1;
+    }
+    return length;
 }
 
+/**
+ * Sets how long a message sent with rudp_send_msg() may wait for others to share its packet.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param delay_us Max wait in microseconds, 0 sends every message at once.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_set_msg_delay(RUDP_Socket *sockfd, unsigned int delay_us){
+    if(sockfd == NULL){
+        return 0;
+    }
+    sockfd->msg_delay_us = delay_us;
+    return 1;
+}
 
-/*
-*   A checksum function that returns 16 bit checksum for data.
-*   This function is taken from RFC1071, can be found here:
-*   https://tools.ietf.org/html/rfc1071
-*
-*/
-unsigned short int calculate_checksum(void *data, unsigned int bytes) {
-    unsigned short int *data_pointer = (unsigned short int *)data;
-    unsigned int total_sum = 0;
-// Main summing loop
-    while (bytes > 1) {
-        total_sum += *data_pointer++;
-        bytes -= 2;
+// Sends the parity of the pending FEC block and waits until the receiver has the whole block.
+static int fec_flush(RUDP_Socket *sockfd){
+    RUDP_Fec* fec = sockfd->fec;
+    if(fec == NULL || fec->count == 0){
+        return 1;
     }
-// Add left-over byte, if any
-    if (bytes > 0)
-        total_sum += *((unsigned char *)data_pointer);
-// Fold 32-bit sum to 16 bits
-    while (total_sum >> 16)
-        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
-    return (~((unsigned short int)total_sum));
-}
\ No newline at end of file
+
+    // parity length holds the XOR of the segment lengths, its checksum covers the whole span
+    fec->parity.header.flags = RUDP_PARITY;
+    fec->parity.header.checksum = calculate_checksum(fec->parity.data, fec->span);
+    fec->parity.header.fec_block = fec->block;
+    fec->parity.header.fec_index = fec->count;
+    fec->parity.header.fec_count = fec->count;
+
+    bool resend = true;
+    bool retransmitted = false;
+    unsigned long long sent_at = now_us();
+    while(1){
+        if(resend && (batch_sendto(sockfd, &fec->parity, sizeof(RUDPHeader) + fec->span) == -1 || batch_flush(sockfd) == -1)){
+            rudp_log_error("sendto failed: %s", strerror(errno));
+            return 0;
+        }
+        resend = true;
+
+        struct sockaddr_in recv_addr;
+        RUDPHeader answer;
+
+        int num_recv_bytes = stats_recvfrom(sockfd, &answer, sizeof(answer), &recv_addr);
+        if(num_recv_bytes == -1){
+
+            if(errno == EWOULDBLOCK || errno == EAGAIN){
+                rudp_log_debug("Timeout occurred, sending parity again");
+                stats_count(&sockfd->stats.retransmits, 1);
+                stats_histogram(sockfd->stats.rto_us, sockfd->rto_us);
+                retransmitted = true;
+                continue;
+            }
+            else{
+                rudp_log_error("Receive failed: %s", strerror(errno));
+                return 0;
+            }
+        }
+
+        if(memcmp(&recv_addr.sin_addr, &sockfd->dest_addr.sin_addr, sizeof(struct in_addr)) != 0 ||
+           recv_addr.sin_port != sockfd->dest_addr.sin_port){
+            rudp_log_error("Received a packet from an unexpected source");
+            return 0;
+        }
+
+        // a late or duplicated ACK of the handshake or of a plain segment, not an answer to the parity
+        if(answer.flags == RUDP_ACK){
+            resend = false;
+            continue;
+        }
+
+        if(answer.flags != (RUDP_ACK | RUDP_PARITY)){
+            rudp_log_error("Wrong packet received");
+            return 0;
+        }
+
+        // late ACK of an earlier block, keep waiting for ours
+        if(answer.fec_block != fec->block){
+            resend = false;
+            continue;
+        }
+
+        if(answer.fec_index == 0){
+            unsigned long long now = now_us();
+            if(!retransmitted){
+                stats_histogram(sockfd->stats.rtt_us, now - sent_at);
+                socket_autotune(sockfd, now - sent_at, (unsigned long long)(fec->count + 1) * (sizeof(RUDPHeader) + fec->span), now - fec->started_us);
+            }
+
+            // the receiver tells how many segments it can take until the application catches up
+            fec->window = answer.window;
+
+            // one parity rebuilds one loss per block, keep the expected losses per block around 1/4
+            fec->loss_rate = 0.875 * fec->loss_rate + 0.125 * ((double)answer.fec_count / fec->count);
+            if(fec->loss_rate > 0.25 / fec->max_k){
+                fec->k = (unsigned int)(0.25 / fec->loss_rate);
+                if(fec->k < 1){
+                    fec->k = 1;
+                }
+            }
+            else{
+                fec->k = fec->max_k;
+            }
+
+            fec->block++;
+            fec->count = 0;
+            return 1;
+        }
+
+        // more segments were lost than the parity can rebuild, retransmit them
+        retransmitted = true;
+        for(unsigned int i = 0; i < fec->count; i++){
+            if(answer.fec_index & (1 << i)){
+                if(batch_sendto(sockfd, &fec->segments[i], sizeof(RUDPHeader) + fec_covered(fec->segments[i].header.length)) == -1){
+                    rudp_log_error("sendto failed: %s", strerror(errno));
+                    return 0;
+                }
+                stats_count(&sockfd->stats.retransmits, 1);
+            }
+        }
+        if(batch_flush(sockfd) == -1){
+            rudp_log_error("sendto failed: %s", strerror(errno));
+            return 0;
+        }
+    }
+}
+
+/**
+ * Starts reading a file into buffer, on the io_uring engine if there is one.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param fd File to read.
+ * @param buffer Where to store the data, must stay valid until rudp_read_wait() returns.
+ * @param length Bytes to read.
+ * @param offset Position in the file to read from.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_read_file(RUDP_Socket *sockfd, int fd, void *buffer, unsigned int length, off_t offset){
+    if(sockfd == NULL || buffer == NULL || sockfd->read_pending){
+        return 0;
+    }
+
+#ifdef RUDP_IO_URING
+    // a ring that receives is left to the datagrams
+    if(sockfd->uring != NULL && sockfd->uring->buf_ring == NULL){
+        if(rudp_uring_read(sockfd->uring, fd, buffer, length, offset) == 0){
+            return 0;
+        }
+        sockfd->read_pending = true;
+        return 1;
+    }
+#endif
+
+    sockfd->read_result = pread(fd, buffer, length, offset);
+    if(sockfd->read_result == -1){
+        rudp_log_error("Error reading file: %s", strerror(errno));
+    }
+    sockfd->read_pending = true;
+    return 1;
+}
+
+/**
+ * Waits for the read started by rudp_read_file().
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @return Number of bytes read, -1 if an error occurs.
+ */
+int rudp_read_wait(RUDP_Socket *sockfd){
+    if(sockfd == NULL || !sockfd->read_pending){
+        return -1;
+    }
+    sockfd->read_pending = false;
+
+#ifdef RUDP_IO_URING
+    if(sockfd->uring != NULL && sockfd->uring->buf_ring == NULL){
+        int result = rudp_uring_wait_read(sockfd->uring);
+        if(result == -1){
+            rudp_log_error("Error reading file: %s", strerror(errno));
+        }
+        return result;
+    }
+#endif
+
+    return sockfd->read_result;
+}
+
+/**
+ * Copies the counters of an RUDP socket.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param stats Filled with the counters collected since the socket was created.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_get_stats(RUDP_Socket *sockfd, RUDP_Stats *stats){
+    if(sockfd == NULL || stats == NULL){
+        return 0;
+    }
+
+    // every field is an atomic_ullong, copied one at a time
+    atomic_ullong* from = (atomic_ullong*)&sockfd->stats;
+    atomic_ullong* to = (atomic_ullong*)stats;
+    for(size_t i = 0; i < sizeof(RUDP_Stats) / sizeof(atomic_ullong); i++){
+        atomic_store_explicit(&to[i], atomic_load_explicit(&from[i], memory_order_relaxed), memory_order_relaxed);
+    }
+    return 1;
+}
+
+static void print_histogram(FILE *out, const char *name, const atomic_ullong *histogram, unsigned int buckets){
+    fprintf(out, ",\"%s\":[", name);
+    for(unsigned int i = 0; i < buckets; i++){
+        fprintf(out, i == 0 ? "%llu" : ",%llu", atomic_load_explicit(&histogram[i], memory_order_relaxed));
+    }
+    fprintf(out, "]");
+}
+
+/**
+ * Writes the counters of an RUDP socket as a single line JSON object.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param out Stream to write to.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_print_stats(RUDP_Socket *sockfd, FILE *out){
+    if(sockfd == NULL || out == NULL){
+        return 0;
+    }
+
+    RUDP_Stats snapshot;
+    rudp_get_stats(sockfd, &snapshot);
+    RUDP_Stats* stats = &snapshot;
+    fprintf(out, "{\"packets_sent\":%llu,\"bytes_sent\":%llu,\"packets_received\":%llu,\"bytes_received\":%llu,"
+                 "\"retransmits\":%llu,\"duplicates\":%llu,\"checksum_failures\":%llu,\"fec_recovered\":%llu,"
+                 "\"window_limited\":%llu,\"window_probes\":%llu,\"rcvbuf\":%u,\"sndbuf\":%u",
+            stats->packets_sent, stats->bytes_sent, stats->packets_received, stats->bytes_received,
+            stats->retransmits, stats->duplicates, stats->checksum_failures, stats->fec_recovered,
+            stats->window_limited, stats->window_probes, atomic_load(&sockfd->rcvbuf), atomic_load(&sockfd->sndbuf));
+    print_histogram(out, "rtt_us", stats->rtt_us, RUDP_STATS_BUCKETS);
+    print_histogram(out, "rto_us", stats->rto_us, RUDP_STATS_BUCKETS);
+    print_histogram(out, "window", stats->window, RUDP_FEC_MAX_K + 1);
+    fprintf(out, "}\n");
+    fflush(out);
+    return 1;
+}
+
+/**
+ * Makes an RUDP socket dump its counters as JSON every interval_ms milliseconds.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param out Stream to write to, NULL to stop dumping.
+ * @param interval_ms Time between two dumps.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_set_stats_dump(RUDP_Socket *sockfd, FILE *out, unsigned int interval_ms){
+    if(sockfd == NULL || (out != NULL && interval_ms == 0)){
+        return 0;
+    }
+
+    stats_dump_stop(sockfd);
+    sockfd->stats_out = out;
+    sockfd->stats_interval_ms = interval_ms;
+    if(out == NULL){
+        return 1;
+    }
+
+    atomic_store(&sockfd->stats_stop, false);
+    if(pthread_create(&sockfd->stats_thread, NULL, stats_dump_thread, sockfd) != 0){
+        rudp_log_error("Error starting the stats dump thread");
+        sockfd->stats_out = NULL;
+        return 0;
+    }
+    sockfd->stats_dumping = true;
+    return 1;
+}
+
+/**
+ * Disconnects from a connected RUDP socket.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @return 1 if disconnection is successful, 0 if an error occurs.
+ */
+int rudp_disconnect(RUDP_Socket *sockfd){
+
+    if(sockfd == NULL || !sockfd->isConnected){
+        return 0;
+    }
+
+    // The receiver must have the pending FEC block and messages before the FIN
+    if(rudp_flush(sockfd) == 0){
+        return 0;
+    }
+
+    // A resumed connection that sent nothing was never opened on the receiver side
+    if(sockfd->resume_pending){
+        sockfd->resume_pending = false;
+        sockfd->isConnected = false;
+        memset(&sockfd->dest_addr, 0, sizeof(sockfd->dest_addr));
+        return 1;
+    }
+
+    RUDPPacket FIN_packet;
+    memset(&FIN_packet, 0, sizeof(FIN_packet));
+    FIN_packet.header.flags = RUDP_FIN;
+
+    if(rudp_send(sockfd, &FIN_packet, sizeof(FIN_packet)) == 0){
+        sockfd->isConnected = false;
+        memset(&sockfd->dest_addr, 0, sizeof(sockfd->dest_addr));
+        if(sockfd->fec != NULL){
+            sockfd->fec->block = 0;
+            sockfd->fec->window = RUDP_FEC_MAX_K;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Closes an RUDP socket.
+ *
+ * @param sockfd Pointer to the RUDP socket to close.
+ * @return 0 on success, -1 if an error occurs.
+ */
+int rudp_close(RUDP_Socket *sockfd){
+    if(sockfd == NULL){
+        return -1;
+    }
+    stats_dump_stop(sockfd);
+#ifdef RUDP_IO_URING
+    // the ring goes first, it may still have a receive on the socket
+    if(sockfd->uring != NULL){
+        rudp_uring_exit(sockfd->uring);
+        free(sockfd->uring);
+    }
+#endif
+    close(sockfd->socket_fd);
+    free(sockfd->fec);
+    free(sockfd->early_data);
+    free(sockfd->msg_out);
+    free(sockfd->msg_in);
+    free(sockfd);
+    return 0;
+}
+
+
+/*
+*   A checksum function that returns 16 bit checksum for data.
+*   This function is taken from RFC1071, can be found here:
+*   https://tools.ietf.org/html/rfc1071
+*
+*/
+unsigned short int calculate_checksum(void *data, unsigned int bytes) {
+    unsigned short int *data_pointer = (unsigned short int *)data;
+    unsigned int total_sum = 0;
+// Main summing loop
+    while (bytes > 1) {
+        total_sum += *data_pointer++;
+        bytes -= 2;
+    }
+// Add left-over byte, if any
+    if (bytes > 0)
+        total_sum += *((unsigned char *)data_pointer);
+// Fold 32-bit sum to 16 bits
+    while (total_sum >> 16)
+        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
+    return (~((unsigned short int)total_sum));
+}
+
+
+// Connection helpers
+
+// Sends the SYN until the receiver acknowledges it, then keeps the session ticket it issued.
+static int handshake(RUDP_Socket *sockfd, const struct sockaddr_in *server_addr, RUDPPacket *SYN_packet, unsigned int syn_size){
+    struct sockaddr_in recv_addr;
+    unsigned long long sent_at = now_us();
+    bool retransmitted = false;
+    bool resend = true;
+
+    while(1){
+        if(resend && stats_sendto(sockfd, SYN_packet, syn_size, server_addr)  == -1){
+
+            rudp_log_error("Error sending SYN Packet: %s", strerror(errno));
+            return 0;  // Failure
+        }
+        resend = true;
+
+        RUDPPacket answer;
+        int num_bytes = stats_recvfrom(sockfd, &answer, sizeof(answer), &recv_addr);
+        if(num_bytes == -1){
+
+            if(errno == EWOULDBLOCK || errno == EAGAIN){
+                rudp_log_debug("Timeout occurred, sending connect request again");
+                stats_count(&sockfd->stats.retransmits, 1);
+                stats_histogram(sockfd->stats.rto_us, sockfd->rto_us);
+                retransmitted = true;
+                continue;
+            }
+            else{
+                rudp_log_error("Receive failed: %s", strerror(errno));
+                return 0;
+            }
+        }
+
+        if(memcmp(&recv_addr.sin_addr, &server_addr->sin_addr, sizeof(struct in_addr)) != 0 ||
+           recv_addr.sin_port != server_addr->sin_port){
+            rudp_log_error("Received a packet from an unexpected source");
+            return 0;
+        }
+
+        if(answer.header.flags == RUDP_SYN){
+            // the receiver answers each copy of a rejected ticketed packet, keep waiting for the ACK
+            resend = false;
+            continue;
+        }
+        if(answer.header.flags != RUDP_ACK){
+            rudp_log_error("Wrong packet received");
+            return 0;
+        }
+
+        if(!retransmitted){
+            stats_histogram(sockfd->stats.rtt_us, now_us() - sent_at);
+        }
+        sockfd->dest_addr = *server_addr;
+        sockfd->isConnected = true;
+        sockfd->ticket = answer.header.ticket;
+        sockfd->ticket_addr = *server_addr;
+        return 1;
+    }
+}
+
+// Ticket the receiver issues to a client. It is bound to the client IP only, since a
+// reconnecting client usually gets a new port. Not a MAC: RUDP has no authentication,
+// the secret only makes a restarted receiver reject tickets of its previous run.
+static unsigned int session_ticket(RUDP_Socket *sockfd, const struct sockaddr_in *addr){
+    unsigned int hash = sockfd->ticket_secret ^ addr->sin_addr.s_addr;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash == 0 ? 1 : hash; // 0 means no ticket
+}
+
+// Copies the data of a DATA packet for the application, returns the rudp_recv() result.
+static int deliver_packet(RUDPPacket *packet, void *buffer, unsigned int buffer_size){
+    memcpy(buffer, packet->data, buffer_size < BUFFER_SIZE ? buffer_size : BUFFER_SIZE);
+    if(packet->data[0] == EOF){
+        return -3;
+    }
+    return packet->header.length;
+}
+
+
+// Message batch helpers
+
+// Sends the queued messages as one DATA packet, after the pending FEC block which was sent before them.
+static int msg_flush(RUDP_Socket *sockfd){
+    if(fec_flush(sockfd) == 0){
+        return 0;
+    }
+    if(sockfd->msg_out_length == 0){
+        return 1;
+    }
+
+    RUDPPacket* batch = sockfd->msg_out;
+    memset(&batch->header, 0, sizeof(batch->header));
+    batch->header.flags = RUDP_DATA | RUDP_MSG;
+    batch->header.length = sockfd->msg_out_length;
+    batch->header.checksum = calculate_checksum(batch->data, batch->header.length);
+
+    if(rudp_send(sockfd, batch, sizeof(RUDPHeader) + batch->header.length) == -1){
+        return 0;
+    }
+    sockfd->msg_out_length = 0;
+    return 1;
+}
+
+// Hands the next record of the received batch to the application.
+static int msg_deliver(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
+    RUDPPacket* batch = sockfd->msg_in;
+    unsigned int offset = sockfd->msg_in_offset;
+    unsigned short record_length = 0;
+
+    if(offset + sizeof(record_length) <= batch->header.length){
+        memcpy(&record_length, batch->data + offset, sizeof(record_length));
+        offset += sizeof(record_length);
+    }
+    if(record_length == 0 || offset + record_length > batch->header.length){
+        rudp_log_error("Malformed message batch");
+        free(sockfd->msg_in);
+        sockfd->msg_in = NULL;
+        return -1;
+    }
+
+    memcpy(buffer, batch->data + offset, record_length < buffer_size ? record_length : buffer_size);
+    sockfd->msg_in_offset = offset + record_length;
+
+    if(sockfd->msg_in_offset >= batch->header.length){
+        free(sockfd->msg_in);
+        sockfd->msg_in = NULL;
+    }
+    return record_length < buffer_size ? record_length : buffer_size;
+}
+
+
+// Stats helpers
+
+static unsigned long long now_us(void){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// Adds n to a counter. Only the thread using the socket writes it, so a relaxed load and store
+// are enough for readers on other threads to always see a whole value.
+static void stats_count(atomic_ullong *counter, unsigned long long n){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void stats_histogram(atomic_ullong *histogram, unsigned long long us){
+    unsigned int bucket = 0;
+    while((us >>= 1) != 0 && bucket < RUDP_STATS_BUCKETS - 1){
+        bucket++;
+    }
+    stats_count(&histogram[bucket], 1);
+}
+
+// Writes the periodic JSON dump of a socket until stats_dump_stop().
+static void* stats_dump_thread(void *arg){
+    RUDP_Socket* sockfd = (RUDP_Socket*)arg;
+
+    // short naps, so stopping the thread does not wait for a whole interval
+    unsigned int nap_ms = sockfd->stats_interval_ms < 10 ? sockfd->stats_interval_ms : 10;
+    struct timespec pause = {0, nap_ms * 1000000L};
+    unsigned long long last_dump_us = now_us();
+
+    while(!atomic_load(&sockfd->stats_stop)){
+        nanosleep(&pause, NULL);
+        unsigned long long now = now_us();
+        if(now - last_dump_us >= sockfd->stats_interval_ms * 1000ULL){
+            last_dump_us = now;
+            rudp_print_stats(sockfd, sockfd->stats_out);
+        }
+    }
+    return NULL;
+}
+
+static void stats_dump_stop(RUDP_Socket *sockfd){
+    if(sockfd->stats_dumping){
+        atomic_store(&sockfd->stats_stop, true);
+        pthread_join(sockfd->stats_thread, NULL);
+        sockfd->stats_dumping = false;
+    }
+}
+
+// sendto() on the socket, counting what was sent.
+static int stats_sendto(RUDP_Socket *sockfd, const void *buffer, size_t length, const struct sockaddr_in *addr){
+    int num_bytes = sendto(sockfd->socket_fd, buffer, length, 0, (const struct sockaddr*) addr, sizeof(*addr));
+    if(num_bytes != -1){
+        stats_count(&sockfd->stats.packets_sent, 1);
+        stats_count(&sockfd->stats.bytes_sent, num_bytes);
+    }
+    return num_bytes;
+}
+
+// recvfrom() on the socket, counting what was received.
+static int stats_recvfrom(RUDP_Socket *sockfd, void *buffer, size_t length, struct sockaddr_in *addr){
+    int num_bytes = socket_recvfrom(sockfd, buffer, length, addr);
+    if(num_bytes != -1){
+        stats_count(&sockfd->stats.packets_received, 1);
+        stats_count(&sockfd->stats.bytes_received, num_bytes);
+    }
+    return num_bytes;
+}
+
+
+// FEC helpers
+
+// Allocates the FEC block state of a socket on first use.
+static RUDP_Fec* fec_alloc(RUDP_Socket *sockfd){
+    if(sockfd->fec == NULL){
+        sockfd->fec = (RUDP_Fec*)calloc(1, sizeof(RUDP_Fec));
+        if(sockfd->fec == NULL){
+            rudp_log_error("Error in FEC state allocation: %s", strerror(errno));
+        }
+    }
+    return sockfd->fec;
+}
+
+static void fec_xor(char *dst, const char *src, unsigned int length){
+    unsigned int i = 0;
+
+    // a word at a time, the data of a packet is not aligned to one
+    for(; i + sizeof(unsigned long long) <= length; i += sizeof(unsigned long long)){
+        unsigned long long a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for(; i < length; i++){
+        dst[i] ^= src[i];
+    }
+}
+
+// Bytes of data a segment of the given length puts on the wire.
+// An empty segment still carries its first byte, the end of file mark lives there.
+static unsigned int fec_covered(unsigned int length){
+    return length > 0 ? length : 1;
+}
+
+// Zeroes whatever an older segment left in a stored slot past the bytes of the new one,
+// the application gets the whole data buffer of a delivered segment.
+static void fec_clear(RUDP_Fec *fec, unsigned int index, unsigned int covered){
+    if(fec->extent[index] > covered){
+        memset(fec->segments[index].data + covered, 0, fec->extent[index] - covered);
+    }
+    fec->extent[index] = covered;
+}
+
+// Moves the receiver on to the next block.
+static void fec_next_block(RUDP_Fec *fec){
+    fec->block++;
+    fec->count = 0;
+    fec->have = 0;
+    fec->next = 0;
+    fec->lost = 0;
+    fec->parity_seen = false;
+    fec->complete = false;
+}
+
+// Sends a block ACK: missing is the bitmap of segments the receiver still needs.
+static int fec_send_ack(RUDP_Socket *sockfd, unsigned short block, u_int8_t missing, u_int8_t lost){
+    RUDPHeader ACK_packet;
+    memset(&ACK_packet, 0, sizeof(ACK_packet));
+    ACK_packet.flags = RUDP_ACK | RUDP_PARITY;
+    ACK_packet.fec_block = block;
+    ACK_packet.fec_index = missing;
+    ACK_packet.fec_count = lost;
+    ACK_packet.window = receive_window(sockfd);
+
+    if(stats_sendto(sockfd, &ACK_packet, sizeof(ACK_packet), &sockfd->dest_addr) == -1){
+        rudp_log_error("Error sending ACK packet: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Sends a DATA packet as the next segment of the current block, without waiting for an ACK.
+// The block is flushed once it holds k segments, or fewer if the receiver window is smaller.
+// With the io_uring engine the segments wait on the ring and go out with the parity.
+static int fec_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size){
+    RUDP_Fec* fec = sockfd->fec;
+    RUDPPacket* segment = &fec->segments[fec->count];
+
+    // a full receiver gets no new block until it advertises room again
+    if(fec->count == 0 && fec->window == 0 && fec_probe(sockfd) == 0){
+        return -1;
+    }
+
+    // the window only changes between blocks, so every segment of a block sees the same size
+    unsigned int size = fec->k;
+    if(fec->window < size){
+        size = fec->window;
+    }
+
+    // only the header and the data go out, a short segment makes a short datagram
+    unsigned int length = ((RUDPPacket*)buffer)->header.length;
+    if(length > BUFFER_SIZE){
+        return -1;
+    }
+    unsigned int covered = fec_covered(length);
+    unsigned int copied = buffer_size < sizeof(RUDPHeader) + covered ? buffer_size : sizeof(RUDPHeader) + covered;
+    memcpy(segment, buffer, copied);
+    memset((char*)segment + copied, 0, sizeof(RUDPHeader) + covered - copied);
+    segment->header.fec_block = fec->block;
+    segment->header.fec_index = fec->count;
+    segment->header.fec_count = size;
+
+    if(batch_sendto(sockfd, segment, sizeof(RUDPHeader) + covered) == -1){
+        rudp_log_error("sendto failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // the parity covers the longest segment, shorter ones count as padded with zeros
+    if(fec->count == 0){
+        fec->started_us = now_us();
+        if(size < fec->k){
+            stats_count(&sockfd->stats.window_limited, 1);
+        }
+        memcpy(fec->parity.data, segment->data, covered);
+        fec->parity.header.length = length;
+        fec->span = covered;
+    }
+    else{
+        if(covered > fec->span){
+            memset(fec->parity.data + fec->span, 0, covered - fec->span);
+            fec->span = covered;
+        }
+        fec_xor(fec->parity.data, segment->data, covered);
+        fec->parity.header.length ^= length;
+    }
+    fec->count++;
+    stats_count(&sockfd->stats.window[fec->count], 1);
+
+    if(fec->count >= size && fec_flush(sockfd) == 0){
+        return -1;
+    }
+    return buffer_size;
+}
+
+// Waits until a receiver that advertised a zero window has room again. The probe is the header of the
+// last parity: the receiver reads it only once its application took the block before, and answers
+// with its window. Probes back off up to RUDP_PROBE_MAX_US instead of going out on every RTO.
+static int fec_probe(RUDP_Socket *sockfd){
+    RUDP_Fec* fec = sockfd->fec;
+    unsigned long long backoff_us = sockfd->rto_us > 0 ? sockfd->rto_us : 1000;
+
+    while(fec->window == 0){
+        if(stats_sendto(sockfd, &fec->parity.header, sizeof(RUDPHeader), &sockfd->dest_addr) == -1){
+            rudp_log_error("sendto failed: %s", strerror(errno));
+            return 0;
+        }
+        stats_count(&sockfd->stats.window_probes, 1);
+
+        unsigned long long sent_at = now_us();
+        while(fec->window == 0 && now_us() - sent_at < backoff_us){
+            struct sockaddr_in recv_addr;
+            RUDPHeader answer;
+            if(stats_recvfrom(sockfd, &answer, sizeof(answer), &recv_addr) == -1){
+                if(errno == EWOULDBLOCK || errno == EAGAIN){
+                    continue;
+                }
+                rudp_log_error("Receive failed: %s", strerror(errno));
+                return 0;
+            }
+            if(memcmp(&recv_addr.sin_addr, &sockfd->dest_addr.sin_addr, sizeof(struct in_addr)) == 0 &&
+               recv_addr.sin_port == sockfd->dest_addr.sin_port && answer.flags == (RUDP_ACK | RUDP_PARITY)){
+                fec->window = answer.window;
+            }
+        }
+        backoff_us = 2 * backoff_us < RUDP_PROBE_MAX_US ? 2 * backoff_us : RUDP_PROBE_MAX_US;
+    }
+    return 1;
+}
+
+// Stores a FEC segment or parity of num_bytes on the receiver side. On parity, rebuilds a single
+// missing segment and answers with the bitmap of segments that still have to be retransmitted.
+static int fec_receive(RUDP_Socket *sockfd, RUDPPacket *packet, unsigned int num_bytes){
+    RUDP_Fec* fec = fec_alloc(sockfd);
+    if(fec == NULL){
+        return -1;
+    }
+
+    unsigned short age = (unsigned short)(fec->block - packet->header.fec_block);
+    if(age != 0){
+        stats_count(&sockfd->stats.duplicates, 1);
+
+        // parity of a finished block again means our ACK was lost
+        if(packet->header.flags == RUDP_PARITY && age < 0x8000){
+            return fec_send_ack(sockfd, packet->header.fec_block, 0, 0);
+        }
+        return 0;
+    }
+
+    // a corrupted segment counts as lost, the parity or a retransmission replaces it.
+    // The parity is as long as the longest segment of its block, its datagram size tells how long.
+    if(num_bytes < sizeof(RUDPHeader)){
+        return 0;
+    }
+    bool parity = packet->header.flags == RUDP_PARITY;
+    unsigned int span = parity ? num_bytes - sizeof(RUDPHeader) : fec_covered(packet->header.length);
+    if(packet->header.fec_count == 0 || packet->header.fec_count > RUDP_FEC_MAX_K ||
+       (!parity && packet->header.fec_index >= packet->header.fec_count) ||
+       span > BUFFER_SIZE || sizeof(RUDPHeader) + span > num_bytes){
+        return 0;
+    }
+    if(packet->header.checksum != calculate_checksum(packet->data, parity ? span : packet->header.length)){
+        stats_count(&sockfd->stats.checksum_failures, 1);
+        return 0;
+    }
+
+    if(packet->header.flags == RUDP_DATA){
+        if(fec->have & (1 << packet->header.fec_index)){
+            stats_count(&sockfd->stats.duplicates, 1);
+        }
+        else{
+            memcpy(&fec->segments[packet->header.fec_index], packet, sizeof(RUDPHeader) + span);
+            fec_clear(fec, packet->header.fec_index, span);
+            fec->have |= 1 << packet->header.fec_index;
+        }
+        return 0;
+    }
+
+    if(fec->parity_seen){
+        stats_count(&sockfd->stats.duplicates, 1);
+    }
+
+    fec->count = packet->header.fec_count;
+    u_int8_t missing = (u_int8_t)((1 << fec->count) - 1) & ~fec->have;
+
+    if(!fec->parity_seen){
+        memcpy(&fec->parity, packet, sizeof(RUDPHeader) + span);
+        fec->span = span;
+        fec->parity_seen = true;
+        fec->lost = __builtin_popcount(missing);
+    }
+
+    // exactly one segment missing: parity XOR all the others rebuilds it
+    if(missing != 0 && (missing & (missing - 1)) == 0){
+        unsigned int index = __builtin_ctz(missing);
+        RUDPPacket* rebuilt = &fec->segments[index];
+
+        memcpy(rebuilt, &fec->parity, sizeof(RUDPHeader) + fec->span);
+        fec_clear(fec, index, fec->span);
+        for(unsigned int i = 0; i < fec->count; i++){
+            if(i != index){
+                unsigned int covered = fec_covered(fec->segments[i].header.length);
+                fec_xor(rebuilt->data, fec->segments[i].data, covered < fec->span ? covered : fec->span);
+                rebuilt->header.length ^= fec->segments[i].header.length;
+            }
+        }
+
+        // a length past the parity means the block does not add up, the segment is retransmitted instead
+        if(fec_covered(rebuilt->header.length) <= fec->span){
+            rebuilt->header.flags = RUDP_DATA;
+            rebuilt->header.checksum = calculate_checksum(rebuilt->data, rebuilt->header.length);
+            rebuilt->header.fec_index = index;
+
+            fec->have |= missing;
+            missing = 0;
+            stats_count(&sockfd->stats.fec_recovered, 1);
+        }
+    }
+
+    fec->complete = (missing == 0);
+    if(fec_send_ack(sockfd, fec->block, missing, fec->lost) == -1){
+        return -1;
+    }
+    if(fec->complete && fec->next == fec->count){
+        fec_next_block(fec);
+    }
+    return 0;
+}
+
+// Hands the next in-order stored segment to the application.
+// Returns false if there is none, otherwise stores the rudp_recv() result in *result.
+static bool fec_deliver(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size, int *result){
+    RUDP_Fec* fec = sockfd->fec;
+    if(fec == NULL || fec->next >= RUDP_FEC_MAX_K || !(fec->have & (1 << fec->next))){
+        return false;
+    }
+
+    *result = deliver_packet(&fec->segments[fec->next++], buffer, buffer_size);
+
+    if(fec->complete && fec->next == fec->count){
+        fec_next_block(fec);
+    }
+    return true;
+}
+
+
+// Flow control helpers
+
+// Sets a kernel socket buffer to bytes of kernel memory, past the system limit when the process may.
+// Returns the size the kernel granted.
+static unsigned int socket_buffer(int fd, int option, int force_option, unsigned int bytes){
+    // the kernel doubles the value to leave room for its bookkeeping, bytes already includes it
+    int value = bytes / 2;
+    if(setsockopt(fd, SOL_SOCKET, force_option, &value, sizeof(value)) == -1 &&
+       setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value)) == -1){
+        rudp_log_warn("Error setting socket buffer size: %s", strerror(errno));
+    }
+
+    socklen_t length = sizeof(value);
+    if(getsockopt(fd, SOL_SOCKET, option, &value, &length) == -1){
+        return 0;
+    }
+    return value;
+}
+
+// Grows the send buffer to twice the bandwidth-delay product, measured when an ACK arrives
+// for bytes sent elapsed_us ago without a retransmission.
+static void socket_autotune(RUDP_Socket *sockfd, unsigned long long rtt_us, unsigned long long bytes, unsigned long long elapsed_us){
+    if(elapsed_us == 0){
+        elapsed_us = 1;
+    }
+    if(sockfd->srtt_us == 0){
+        sockfd->srtt_us = rtt_us;
+        sockfd->delivery_rate = (double)bytes / elapsed_us;
+    }
+    else{
+        sockfd->srtt_us = 0.875 * sockfd->srtt_us + 0.125 * rtt_us;
+        sockfd->delivery_rate = 0.875 * sockfd->delivery_rate + 0.125 * ((double)bytes / elapsed_us);
+    }
+
+    // every byte sent takes about twice its size in kernel memory, like in socket_buffer()
+    double target = 4 * sockfd->delivery_rate * sockfd->srtt_us;
+    if(target > RUDP_SOCKET_BUFFER_MAX){
+        target = RUDP_SOCKET_BUFFER_MAX;
+    }
+
+    // resize only on a real change, not on every jitter of the estimate
+    if(target > 1.25 * sockfd->sndbuf){
+        sockfd->sndbuf = socket_buffer(sockfd->socket_fd, SO_SNDBUF, SO_SNDBUFFORCE, (unsigned int)target);
+        rudp_log_debug("Send buffer set to %u bytes", sockfd->sndbuf);
+    }
+}
+
+// Segments the receiver can take before the application reads more. Like the TCP window, the
+// receive buffer size is the budget for everything not handed to the application yet: segments
+// of the current block rudp_recv() did not return, and datagrams queued in the kernel, where the
+// next block waits meanwhile. A slow application closes the window, down to 0.
+// A budget more than half used is grown first, so a briefly slow application does not stall the sender.
+static unsigned short receive_window(RUDP_Socket *sockfd){
+#ifdef SO_MEMINFO
+    unsigned int meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+    if(getsockopt(sockfd->socket_fd, SOL_SOCKET, SO_MEMINFO, meminfo, &length) == 0){
+        unsigned int rcvbuf = meminfo[SK_MEMINFO_RCVBUF];
+        unsigned int queued = meminfo[SK_MEMINFO_RMEM_ALLOC];
+#ifdef RUDP_IO_URING
+        // datagrams the multishot receive already took out of the socket wait on the ring
+        if(sockfd->uring != NULL && sockfd->uring->buf_ring != NULL){
+            queued += rudp_uring_ready(sockfd->uring) * RUDP_PACKET_TRUESIZE;
+        }
+#endif
+
+        RUDP_Fec* fec = sockfd->fec;
+        if(fec != NULL && fec->count > fec->next){
+            queued += (fec->count - fec->next) * RUDP_PACKET_TRUESIZE;
+        }
+
+        if(queued > rcvbuf / 2 && rcvbuf < RUDP_SOCKET_BUFFER_MAX){
+            unsigned int grown = 2 * rcvbuf < RUDP_SOCKET_BUFFER_MAX ? 2 * rcvbuf : RUDP_SOCKET_BUFFER_MAX;
+            rcvbuf = socket_buffer(sockfd->socket_fd, SO_RCVBUF, SO_RCVBUFFORCE, grown);
+            rudp_log_debug("Receive buffer set to %u bytes", rcvbuf);
+        }
+        sockfd->rcvbuf = rcvbuf;
+
+        // the parity of the next block needs room too
+        unsigned int window = rcvbuf > queued ? (rcvbuf - queued) / RUDP_PACKET_TRUESIZE : 0;
+        window = window > 1 ? window - 1 : 0;
+        return window < RUDP_FEC_MAX_K ? window : RUDP_FEC_MAX_K;
+    }
+#endif
+    return RUDP_FEC_MAX_K;
+}
+
+
+// I/O engine helpers
+
+// recvfrom() on the socket, through the multishot receive of the io_uring engine when it has one.
+static int socket_recvfrom(RUDP_Socket *sockfd, void *buffer, size_t length, struct sockaddr_in *addr){
+#ifdef RUDP_IO_URING
+    if(sockfd->uring != NULL && sockfd->uring->buf_ring != NULL){
+        return rudp_uring_recvfrom(sockfd->uring, sockfd->socket_fd, buffer, length, addr);
+    }
+#endif
+    while(1){
+        socklen_t addrlen = sizeof(*addr);
+        int result = recvfrom(sockfd->socket_fd, buffer, length, 0, (struct sockaddr*) addr, &addrlen);
+        if(result == -1 && errno == EINTR){
+            continue;
+        }
+        if(result != 0){
+            return result;
+        }
+
+        // RUDP sends no empty datagram. recvfrom() also returns 0 once another thread shut the
+        // socket down, report it like the io_uring engine does instead of a packet
+        struct pollfd pfd = {sockfd->socket_fd, POLLRDHUP, 0};
+        if(poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP))){
+            errno = ESHUTDOWN;
+            return -1;
+        }
+    }
+}
+
+// Sends a packet of a batch to the peer. With the io_uring engine it waits on the ring until
+// batch_flush() sends the whole batch in one system call, so buffer must stay unchanged until then.
+static int batch_sendto(RUDP_Socket *sockfd, const void *buffer, size_t length){
+#ifdef RUDP_IO_URING
+    if(sockfd->uring != NULL){
+        return rudp_uring_sendto(sockfd->uring, sockfd->socket_fd, buffer, length, &sockfd->dest_addr) ? (int)length : -1;
+    }
+#endif
+    return stats_sendto(sockfd, buffer, length, &sockfd->dest_addr);
+}
+
+// Sends the batch queued by batch_sendto() and waits until it is out.
+static int batch_flush(RUDP_Socket *sockfd){
+#ifdef RUDP_IO_URING
+    if(sockfd->uring != NULL){
+        int result = rudp_uring_wait_sends(sockfd->uring);
+        stats_count(&sockfd->stats.packets_sent, sockfd->uring->sent_packets);
+        stats_count(&sockfd->stats.bytes_sent, sockfd->uring->sent_bytes);
+        sockfd->uring->sent_packets = 0;
+        sockfd->uring->sent_bytes = 0;
+        return result;
+    }
+#endif
+    return 0;
+}
@@ -3,6 +3,8 @@
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <linux/sock_diag.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -10,19 +12,41 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "RUDP_Log.h"
 
-#define BUFFER_SIZE 65500
+// header + data must fit in a single UDP datagram (65507 bytes)
+#define BUFFER_SIZE 65480
 
 #define RUDP_SYN 0x01
 #define RUDP_ACK 0x02
 #define RUDP_FIN 0x04
 #define RUDP_DATA 0x08
+#define RUDP_PARITY 0x10
+#define RUDP_MSG 0x20 // with RUDP_DATA: the data is a batch of records, each a 2 byte length followed by the record
+
+#define RUDP_TICKET_REJECT_US 10000 // a rejected session ticket is answered at most once per interval
+#define RUDP_MSG_DELAY_US 200 // default time a small message may wait for others to share its packet
+
+#define RUDP_FEC_MAX_K 8 // max data segments per FEC block (one bit each in the ACK bitmap)
+#define RUDP_PROBE_MAX_US 100000 // longest wait between two probes of a receiver that advertised a zero window
+
+#define RUDP_SOCKET_BUFFER_MAX (8 * 1024 * 1024) // upper bound of socket buffer autotuning
+#define RUDP_PACKET_TRUESIZE (sizeof(RUDPPacket) + 1024) // kernel memory a queued full packet takes, with its overhead
+
+#define RUDP_STATS_BUCKETS 16 // histogram bucket i counts samples in [2^i, 2^(i+1)) microseconds
 
 
 typedef struct RUDPHeader{
     unsigned short length; // length of data
     unsigned short checksum; // checksum of data
     u_int8_t flags;
+    u_int8_t fec_index; // index of the segment in its FEC block. In FEC ACKs: bitmap of missing segments
+    u_int8_t fec_count; // data segments in the FEC block, 0 when FEC is off. In FEC ACKs: segments lost before recovery
+    unsigned short fec_block; // FEC block sequence number
+    unsigned short window; // In FEC ACKs: segments the receiver can take before the application reads more, 0 to pause the sender
+    unsigned int ticket; // session ticket: issued in the SYN ACK, presented on the first DATA of a resumed connection
 }RUDPHeader;
 
 typedef struct RUDPPacket{
@@ -31,14 +55,88 @@ typedef struct RUDPPacket{
 }RUDPPacket;
 
 
+// Per-socket counters. Only the thread using the socket updates them, but they are atomic so another
+// thread can read them with rudp_get_stats() or the periodic dump. Every counter is an atomic_ullong.
+typedef struct RUDPStats{
+    atomic_ullong packets_sent; // every datagram sent, including ACKs and retransmissions
+    atomic_ullong bytes_sent;
+    atomic_ullong packets_received; // every datagram received
+    atomic_ullong bytes_received;
+    atomic_ullong retransmits; // packets sent again after a timeout or a FEC NACK
+    atomic_ullong duplicates; // packets the receiver already had (SYN retransmissions, FEC segments and parities)
+    atomic_ullong checksum_failures;
+    atomic_ullong fec_recovered; // segments rebuilt from parity instead of retransmitted
+    atomic_ullong window_limited; // FEC blocks the sender cut short because the receiver window was smaller than k
+    atomic_ullong window_probes; // probes sent to a receiver that advertised a zero window
+    atomic_ullong rtt_us[RUDP_STATS_BUCKETS]; // round trip times of packets acknowledged without a retransmission
+    atomic_ullong rto_us[RUDP_STATS_BUCKETS]; // retransmission timeout in effect each time one fired
+    atomic_ullong window[RUDP_FEC_MAX_K + 1]; // unacknowledged segments right after each new DATA segment is sent
+} RUDP_Stats;
+
 typedef struct rudp_socket
 {
     int socket_fd; // UDP socket file descriptor
     bool isServer; // True if the RUDP socket acts like a server, false for client.
     bool isConnected; // True if there is an active connection, false otherwise.
     struct sockaddr_in dest_addr; // Destination address. Client fills it when it connects via rudp_connect(), server fills it when it accepts a connection via rudp_accept().
+    struct RUDPFec* fec; // FEC block state, NULL until FEC is enabled (sender) or the first FEC segment arrives (receiver).
+    unsigned int rto_us; // Receive timeout used to detect lost packets, 0 if receives block.
+    atomic_uint rcvbuf; // Kernel receive buffer size, grown when datagrams pile up unread. Atomic for the stats dump.
+    atomic_uint sndbuf; // Kernel send buffer size, grown to the bandwidth-delay product. Atomic for the stats dump.
+    double srtt_us; // Smoothed round trip time.
+    double delivery_rate; // Smoothed acknowledged bytes per microsecond.
+    RUDP_Stats stats; // Connection counters, see rudp_get_stats().
+    FILE* stats_out; // Periodic JSON stats dump target, NULL when disabled.
+    unsigned int stats_interval_ms; // Interval between two periodic dumps.
+    pthread_t stats_thread; // Thread writing the periodic dumps, off the socket calls.
+    bool stats_dumping; // The dump thread runs.
+    atomic_bool stats_stop; // Tells the dump thread to exit.
+    unsigned int ticket_secret; // Server: key of the session tickets it issues.
+    unsigned int rejected_ticket; // Server: last ticket answered with a SYN, 0 if none.
+    unsigned long long rejected_at_us; // Server: time rejected_ticket was last answered.
+    unsigned int ticket; // Client: session ticket of ticket_addr, 0 if none. Kept across rudp_disconnect().
+    struct sockaddr_in ticket_addr; // Client: receiver that issued the ticket.
+    bool resume_pending; // Client: connected without a handshake, the next packet carries the ticket.
+    RUDPPacket* early_data; // Server: DATA that arrived with the connection request, handed out by the next rudp_recv().
+    RUDPPacket* msg_out; // Batch of small messages being filled by rudp_send_msg(), NULL until the first one.
+    unsigned int msg_out_length; // Bytes used in msg_out, 0 when no message is pending.
+    unsigned long long msg_out_since; // Time the oldest pending message was queued.
+    unsigned int msg_delay_us; // Max time a message waits for others before its batch is sent.
+    RUDPPacket* msg_in; // Received batch whose records rudp_recv() hands out one at a time, NULL if none.
+    unsigned int msg_in_offset; // Offset of the next record in msg_in.
+    struct RUDPUring* uring; // io_uring engine, NULL in the blocking build or if the kernel has none.
+    bool read_pending; // A file read started by rudp_read_file() has not been waited for.
+    int read_result; // Result of the file read, when it was done without the engine.
 } RUDP_Socket;
 
+// Session of a client, to resume it from another socket or process without a handshake.
+typedef struct RUDPSession{
+    struct sockaddr_in addr; // receiver that issued the ticket
+    unsigned int ticket;
+} RUDP_Session;
+
+// State of the FEC block currently being sent or received.
+// Every block carries up to k data segments followed by one XOR parity segment,
+// so the receiver can rebuild a single lost segment per block without a retransmission.
+typedef struct RUDPFec{
+    unsigned int max_k; // upper bound for k, set by rudp_set_fec()
+    unsigned int k; // data segments per block, adapted to the observed loss rate
+    unsigned int window; // sender: segments the receiver advertised it can take, caps the block size. 0 waits for a probe
+    double loss_rate; // smoothed fraction of segments lost per block
+    unsigned long long started_us; // sender: time the first segment of the current block was sent
+    unsigned short block; // sequence number of the current block
+    u_int8_t count; // data segments in the current block
+    unsigned int span; // bytes of data the parity covers: the longest segment of the block
+    u_int8_t have; // receiver: bitmap of segments stored in the current block
+    u_int8_t next; // receiver: next segment to hand to the application
+    u_int8_t lost; // receiver: segments lost in the current block before recovery
+    bool parity_seen; // receiver: parity of the current block arrived
+    bool complete; // receiver: every segment of the current block is stored
+    RUDPPacket parity;
+    RUDPPacket segments[RUDP_FEC_MAX_K];
+    unsigned int extent[RUDP_FEC_MAX_K]; // receiver: bytes of each stored segment that may be non-zero
+} RUDP_Fec;
+
 
 
 /**
@@ -53,6 +151,8 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port);
 
 /**
  * Initiates a connection to a remote RUDP socket.
+ * If the socket holds a session ticket of that receiver, the handshake is skipped
+ * and the ticket travels with the next packet sent.
  *
  * @param sockfd Pointer to the RUDP socket.
  * @param dest_ip IP address of the remote socket.
@@ -61,8 +161,43 @@ RUDP_Socket* rudp_socket(bool isServer, unsigned short int listen_port);
  */
 int rudp_connect(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port);
 
+/**
+ * Initiates a connection to a remote RUDP socket, sending the first DATA packet with the connection request.
+ * The data is acknowledged together with the connection, saving a round trip.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param dest_ip IP address of the remote socket.
+ * @param dest_port Port of the remote socket.
+ * @param buffer DATA packet to send, as for rudp_send().
+ * @param buffer_size Size of the data to send.
+ * @return 1 if the connection is successful and the data acknowledged, 0 if an error occurs.
+ */
+int rudp_connect_data(RUDP_Socket *sockfd, const char *dest_ip, unsigned short int dest_port, void *buffer, unsigned int buffer_size);
+
+/**
+ * Copies the session ticket of a client RUDP socket, issued by the receiver on the last handshake.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param session Filled with the session.
+ * @return 1 on success, 0 if the socket has no ticket.
+ */
+int rudp_get_session(RUDP_Socket *sockfd, RUDP_Session *session);
+
+/**
+ * Gives a client RUDP socket a session saved with rudp_get_session(), so its next
+ * rudp_connect() to the same receiver skips the handshake.
+ *
+ * @param sockfd Pointer to the RUDP socket.
+ * @param session Session to resume.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_set_session(RUDP_Socket *sockfd, const RUDP_Session *session);
+
 /**
  * Accepts an incoming connection request on a server RUDP socket.
+ * A request is a SYN, optionally carrying the first DATA packet, or a DATA packet with a valid session ticket.
+ * DATA that came with the request is returned by the next rudp_recv().
+ * A shutdown() of the socket by another thread makes a waiting rudp_accept() or rudp_recv() fail.
  *
  * @param sockfd Pointer to the RUDP socket.
  * @return 1 if the connection is accepted, 0 if an error occurs.
@@ -71,12 +206,14 @@ int rudp_accept(RUDP_Socket *sockfd);
 
 /**
  * Receives data on a connected RUDP socket.
+ * On a client, the messages queued by rudp_send_msg() are sent before waiting.
  *
  * @param sockfd Pointer to the RUDP socket.
  * @param buffer Buffer to store received data.
  * @param buffer_size Size of the buffer.
- * @return Number of bytes received if received DATA packet, -2 if got SYN packet
+ * @return Number of bytes received if received DATA packet or message, -2 if got SYN packet
  * -3 if got EOF DATA packet, 0 if got FIN packet, -1 if an error occurs.
+ * Messages sent with rudp_send_msg() are returned one per call, truncated to buffer_size.
  */
 int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
 
@@ -84,12 +221,109 @@ int rudp_recv(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
 * Sends data on a connected RUDP socket.
 *
 * @param sockfd Pointer to the RUDP socket.
-* @param buffer Data to send.
+* @param buffer Data to send. On the first packet of a resumed connection its header.ticket is filled in.
 * @param buffer_size Size of the data to send.
 * @return Number of bytes sent if sent DATA packet, 0 if sent FIN packet, -1 if an error occurs.
 */
 int rudp_send(RUDP_Socket *sockfd, void *buffer, unsigned int buffer_size);
 
+/**
+* Enables forward error correction on a client RUDP socket.
+* DATA packets are then sent in blocks of up to max_k segments plus one XOR parity segment,
+* and acknowledged once per block. The block size shrinks when the receiver reports losses.
+* The receiver detects FEC blocks by itself and needs no setup.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param max_k Max data segments per block (1 to RUDP_FEC_MAX_K), 0 to turn FEC off.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_set_fec(RUDP_Socket *sockfd, unsigned int max_k);
+
+/**
+* Queues a small message. Messages are coalesced into one DATA packet that is sent when it is full,
+* when the oldest message waited longer than the message delay, or on rudp_flush().
+* Nothing runs in the background: the delay is only checked by rudp_send_msg() itself, and rudp_send(),
+* rudp_recv() and rudp_disconnect() send the pending messages first. An application that stops calling
+* the socket any other way (waiting for input, a timer, another socket) must call rudp_flush() before,
+* or its last messages stay queued until it does.
+* The receiver gets the messages one per rudp_recv() call, with their boundaries kept.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param msg Message to send.
+* @param length Size of the message, 1 to BUFFER_SIZE - 2 bytes.
+* @return length on success, -1 if an error occurs.
+*/
+int rudp_send_msg(RUDP_Socket *sockfd, const void *msg, unsigned int length);
+
+/**
+* Sets how long a message sent with rudp_send_msg() may wait for others to share its packet.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param delay_us Max wait in microseconds, 0 sends every message at once.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_set_msg_delay(RUDP_Socket *sockfd, unsigned int delay_us);
+
+/**
+* Sends the pending FEC block parity and the pending small messages, and waits until the receiver has them.
+* Does nothing if nothing is pending.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_flush(RUDP_Socket *sockfd);
+
+/**
+* Starts reading a file into buffer. With the io_uring engine (make uring) the read goes to
+* the kernel right away and the call returns, so the disk works while the socket does.
+* Otherwise the file is read before the call returns. Only one read may be pending.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param fd File to read.
+* @param buffer Where to store the data, must stay valid until rudp_read_wait() returns.
+* @param length Bytes to read.
+* @param offset Position in the file to read from.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_read_file(RUDP_Socket *sockfd, int fd, void *buffer, unsigned int length, off_t offset);
+
+/**
+* Waits for the read started by rudp_read_file().
+*
+* @param sockfd Pointer to the RUDP socket.
+* @return Number of bytes read, -1 if an error occurs.
+*/
+int rudp_read_wait(RUDP_Socket *sockfd);
+
+/**
+* Copies the counters of an RUDP socket.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param stats Filled with the counters collected since the socket was created.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_get_stats(RUDP_Socket *sockfd, RUDP_Stats *stats);
+
+/**
+* Writes the counters of an RUDP socket as a single line JSON object.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param out Stream to write to.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_print_stats(RUDP_Socket *sockfd, FILE *out);
+
+/**
+* Makes an RUDP socket dump its counters as JSON every interval_ms milliseconds.
+* A background thread writes the dumps, so the socket calls never wait for the stream.
+*
+* @param sockfd Pointer to the RUDP socket.
+* @param out Stream to write to, NULL to stop dumping.
+* @param interval_ms Time between two dumps.
+* @return 1 on success, 0 if an error occurs.
+*/
+int rudp_set_stats_dump(RUDP_Socket *sockfd, FILE *out, unsigned int interval_ms);
+
 /**
 * Disconnects from a connected RUDP socket.
 *
@@ -0,0 +1,548 @@
+#define _GNU_SOURCE // RUSAGE_THREAD, ppoll()
+#include "RUDP.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define SHIM_QUEUE_SIZE 256 // packets held by the shim, more are dropped like a full router queue
+#define SHIM_REORDER_US 1000 // extra hold time of a reordered packet, later packets overtake it
+#define MAX_SWEEP 16
+#define RECEIVER_GRACE_MS 1000 // time the receiver gets to take what the sender already sent
+#define BENCH_DEADLINE_S 60 // default time one sweep point may take before it counts as stuck
+#define STAMP_OFFSET 2 // message index in the payload, past a first byte that must not be EOF
+#define STAMP_SIZE (2 * sizeof(unsigned int)) // the index and its complement
+
+// Impairments the shim applies to every packet, in both directions.
+struct ShimConfig {
+    double loss;    // drop probability in percent
+    double dup;     // duplication probability in percent
+    double reorder; // probability in percent of holding a packet so later ones overtake it
+    unsigned int delay_us;  // fixed one way delay
+    unsigned int jitter_us; // random extra delay, 0 to jitter_us
+};
+
+struct ShimPacket {
+    unsigned long long release_us; // when the packet leaves the shim
+    int out_fd;
+    struct sockaddr_in to;
+    size_t length;
+    char* data;
+};
+
+// UDP relay between the sender and the receiver:
+// sender <-> sender_fd (shim port) | receiver_fd <-> receiver
+struct Shim {
+    struct ShimConfig config;
+    int sender_fd;
+    int receiver_fd;
+    unsigned short port; // port the sender connects to
+    struct sockaddr_in sender_addr; // learned from the first packet
+    struct sockaddr_in receiver_addr;
+    struct ShimPacket queue[SHIM_QUEUE_SIZE];
+    int queued;
+    volatile bool stop;
+    unsigned int seed;
+};
+
+struct ReceiverThread {
+    RUDP_Socket* sock;
+    unsigned int connections; // connections to accept one after the other
+    unsigned int messages;
+    unsigned long long* arrivals; // time each message index first reached the application, 0 until then
+    unsigned long long bytes; // payload bytes received
+    double cpu_s; // CPU time used by the receiver thread
+    volatile bool lingering; // every connection was closed, only late FINs are answered now
+};
+
+// Fails a sweep point that runs past its deadline by shutting both endpoints down,
+// every blocked send and receive then returns an error.
+struct Watchdog {
+    RUDP_Socket* sender;
+    RUDP_Socket* receiver;
+    unsigned long long deadline_us;
+    volatile bool done; // the point finished, the watchdog leaves it alone
+    volatile bool expired;
+};
+
+// One line of benchmark output
+struct BenchResult {
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    double seconds;
+    double latency_p50_us;
+    double latency_p99_us;
+    double cpu_s;
+    unsigned long long retransmits;
+};
+
+unsigned long long nowMicros(void);
+double threadCpuSeconds(void);
+int parseList(char* list, double* values);
+int openLoopbackSocket(unsigned short* port);
+void* runShim(void* arg);
+void* runReceiver(void* arg);
+void* runWatchdog(void* arg);
+void stampMessage(char* data, unsigned int index);
+int runBench(struct ShimConfig* config, unsigned int payload, unsigned int messages, unsigned int connections,
+             unsigned int fec, int msgDelay, unsigned int deadline, struct BenchResult* result);
+int compareDoubles(const void* a, const void* b);
+
+int main(int argc, char** argv) {
+
+    // Defaults of the sweep, every option takes one value
+    char defaultSizes[] = "64,1024,16384,65480";
+    char defaultLoss[] = "0,1,5,10";
+    char* sizesArg = defaultSizes;
+    char* lossArg = defaultLoss;
+    struct ShimConfig config = {0};
+    unsigned int messages = 2000;
+    unsigned int connections = 1;
+    unsigned int fec = 0;
+    int msgDelay = -1; // -1 sends one packet per message, otherwise rudp_send_msg() batching with this delay
+    unsigned int deadline = BENCH_DEADLINE_S;
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Usage: %s [-sizes <bytes,...>] [-loss <percent,...>] [-n <messages>] "
+                            "[-delay <us>] [-jitter <us>] [-dup <percent>] [-reorder <percent>] [-fec <block_size>] [-msg <delay_us>] "
+                            "[-conns <connections>] [-deadline <seconds>]\n", argv[0]);
+            exit(1);
+        }
+        if (strcmp(argv[i], "-sizes") == 0) sizesArg = argv[i + 1];
+        else if (strcmp(argv[i], "-loss") == 0) lossArg = argv[i + 1];
+        else if (strcmp(argv[i], "-n") == 0) messages = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-delay") == 0) config.delay_us = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-jitter") == 0) config.jitter_us = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-dup") == 0) config.dup = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-reorder") == 0) config.reorder = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-fec") == 0) fec = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-msg") == 0) msgDelay = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-conns") == 0) connections = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-deadline") == 0) deadline = atoi(argv[i + 1]);
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    double sizes[MAX_SWEEP], losses[MAX_SWEEP];
+    int numSizes = parseList(sizesArg, sizes);
+    int numLosses = parseList(lossArg, losses);
+    if (numSizes == 0 || numLosses == 0 || messages == 0 || connections == 0 || connections > messages || deadline == 0) {
+        fprintf(stderr, "Invalid sweep\n");
+        exit(1);
+    }
+
+    rudp_log_set_level(RUDP_LOG_ERROR, stderr);
+
+    // One JSON object per line, one line per sweep point
+    for (int s = 0; s < numSizes; s++) {
+        unsigned int payload = (unsigned int) sizes[s];
+        unsigned int minPayload = STAMP_OFFSET + STAMP_SIZE;
+        unsigned int maxPayload = msgDelay >= 0 ? BUFFER_SIZE - sizeof(unsigned short) : BUFFER_SIZE;
+        if (payload < minPayload || payload > maxPayload) {
+            fprintf(stderr, "Payload size must be %u to %u bytes\n", minPayload, maxPayload);
+            exit(1);
+        }
+
+        for (int l = 0; l < numLosses; l++) {
+            config.loss = losses[l];
+
+            struct BenchResult result;
+            if (runBench(&config, payload, messages, connections, fec, msgDelay, deadline, &result) == -1) {
+                return -1;
+            }
+
+            // bytes_received also counts duplicates the receiver could not tell apart, rate on what was sent
+            double megabytes = result.bytes_sent / (1024.0 * 1024.0);
+            double gigabytes = result.bytes_sent / 1e9;
+            printf("{\"payload\":%u,\"messages\":%u,\"connections\":%u,\"fec\":%u,\"msg_delay_us\":%d,\"loss_pct\":%.2f,\"dup_pct\":%.2f,\"reorder_pct\":%.2f,"
+                   "\"delay_us\":%u,\"jitter_us\":%u,\"bytes_sent\":%llu,\"bytes_received\":%llu,\"seconds\":%.6f,"
+                   "\"throughput_MBps\":%.3f,\"latency_p50_us\":%.1f,\"latency_p99_us\":%.1f,\"cpu_s_per_GB\":%.3f,"
+                   "\"retransmits\":%llu}\n",
+                   payload, messages, connections, fec, msgDelay, config.loss, config.dup, config.reorder, config.delay_us, config.jitter_us,
+                   result.bytes_sent, result.bytes_received, result.seconds,
+                   megabytes / result.seconds, result.latency_p50_us, result.latency_p99_us,
+                   gigabytes > 0 ? result.cpu_s / gigabytes : 0.0, result.retransmits);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
+
+// Runs one transfer of messages * payload bytes through the shim and measures it.
+// The messages are split over connections opened one after the other.
+// A transfer still running after deadline seconds fails.
+int runBench(struct ShimConfig* config, unsigned int payload, unsigned int messages, unsigned int connections,
+             unsigned int fec, int msgDelay, unsigned int deadline, struct BenchResult* result) {
+
+    memset(result, 0, sizeof(*result));
+
+    // Receiver on an ephemeral port
+    struct ReceiverThread receiver = {0};
+    receiver.sock = rudp_socket(true, 0);
+    receiver.connections = connections;
+    receiver.messages = messages;
+    receiver.arrivals = calloc(messages, sizeof(unsigned long long));
+    if (receiver.sock == NULL) {
+        return -1;
+    }
+    struct sockaddr_in receiverAddr;
+    socklen_t addrLen = sizeof(receiverAddr);
+    getsockname(receiver.sock->socket_fd, (struct sockaddr*) &receiverAddr, &addrLen);
+
+    // Shim between sender and receiver
+    struct Shim* shim = calloc(1, sizeof(struct Shim));
+    if (shim == NULL) {
+        rudp_close(receiver.sock);
+        return -1;
+    }
+    shim->config = *config;
+    shim->seed = 1; // same impairments on every run
+    shim->receiver_addr.sin_family = AF_INET;
+    shim->receiver_addr.sin_port = receiverAddr.sin_port;
+    shim->receiver_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    shim->sender_fd = openLoopbackSocket(&shim->port);
+    shim->receiver_fd = openLoopbackSocket(NULL);
+    if (shim->sender_fd == -1 || shim->receiver_fd == -1) {
+        rudp_close(receiver.sock);
+        free(shim);
+        return -1;
+    }
+
+    pthread_t shimThread, receiverThread;
+    pthread_create(&shimThread, NULL, runShim, shim);
+    pthread_create(&receiverThread, NULL, runReceiver, &receiver);
+
+    RUDP_Socket* sock = rudp_socket(false, 0);
+    int status = -1;
+
+    pthread_t watchdogThread;
+    struct Watchdog watchdog = {0};
+    watchdog.sender = sock;
+    watchdog.receiver = receiver.sock;
+    watchdog.deadline_us = nowMicros() + deadline * 1000000ULL;
+    pthread_create(&watchdogThread, NULL, runWatchdog, &watchdog);
+
+    double* latencies = malloc(messages * sizeof(double));
+    unsigned long long* departures = malloc(messages * sizeof(unsigned long long));
+
+    if (sock != NULL && latencies != NULL && departures != NULL && receiver.arrivals != NULL &&
+        (fec == 0 || rudp_set_fec(sock, fec) == 1) &&
+        (msgDelay < 0 || rudp_set_msg_delay(sock, msgDelay) == 1)) {
+
+        RUDPPacket packet;
+        memset(&packet, 0, sizeof(packet));
+        memset(packet.data, 'a', payload); // never starts with EOF
+        stampMessage(packet.data, 0);
+        packet.header.flags = RUDP_DATA;
+        packet.header.length = payload;
+        packet.header.checksum = calculate_checksum(packet.data, payload); // the same for every index
+
+        double cpuStart = threadCpuSeconds();
+        unsigned long long start = nowMicros();
+        unsigned int sent;
+        unsigned int perConnection = (messages + connections - 1) / connections;
+
+        for (sent = 0; sent < messages; sent++) {
+            stampMessage(packet.data, sent);
+            departures[sent] = nowMicros();
+            int sendResult;
+            if (sent % perConnection == 0) {
+                // Every connection opens with its first message. The socket keeps the session
+                // ticket of the previous connection, so the later ones skip the handshake.
+                if (sent > 0 && rudp_disconnect(sock) == 0) {
+                    break;
+                }
+                sendResult = rudp_connect_data(sock, "127.0.0.1", shim->port, &packet, sizeof(RUDPHeader) + payload) == 1 ? 0 : -1;
+            } else {
+                sendResult = msgDelay >= 0 ? rudp_send_msg(sock, packet.data, payload)
+                                           : rudp_send(sock, &packet, sizeof(RUDPHeader) + payload);
+            }
+            if (sendResult == -1) {
+                break;
+            }
+            result->bytes_sent += payload;
+        }
+
+        if (sent == messages && rudp_disconnect(sock) == 1) {
+            status = 0;
+        }
+        result->seconds = (nowMicros() - start) / 1e6;
+        result->cpu_s = threadCpuSeconds() - cpuStart;
+
+        RUDP_Stats stats;
+        rudp_get_stats(sock, &stats);
+        result->retransmits = stats.retransmits;
+    }
+
+    // The receiver is stopped by shutting its socket down. It may still be taking packets the sender
+    // saw acknowledged by a late ACK, so a finished transfer gives it some time to reach the last FIN.
+    for (int i = 0; status == 0 && !receiver.lingering && i < RECEIVER_GRACE_MS; i++) {
+        usleep(1000);
+    }
+    shutdown(receiver.sock->socket_fd, SHUT_RDWR);
+    pthread_join(receiverThread, NULL);
+    watchdog.done = true;
+    pthread_join(watchdogThread, NULL);
+    if (watchdog.expired) {
+        status = -1;
+    }
+    shim->stop = true;
+    pthread_join(shimThread, NULL);
+
+    // Latency runs from the send call to the receiving application, so queued messages count their wait
+    if (status == 0) {
+        unsigned int delivered = 0;
+        for (unsigned int i = 0; i < messages; i++) {
+            if (receiver.arrivals[i] != 0) {
+                latencies[delivered++] = receiver.arrivals[i] > departures[i] ? receiver.arrivals[i] - departures[i] : 0;
+            }
+        }
+        if (delivered > 0) {
+            qsort(latencies, delivered, sizeof(double), compareDoubles);
+            result->latency_p50_us = latencies[delivered / 2];
+            result->latency_p99_us = latencies[(delivered * 99) / 100];
+        }
+    }
+
+    result->bytes_received = receiver.bytes;
+    result->cpu_s += receiver.cpu_s;
+
+    for (int i = 0; i < shim->queued; i++) {
+        free(shim->queue[i].data);
+    }
+    close(shim->sender_fd);
+    close(shim->receiver_fd);
+    free(shim);
+    free(latencies);
+    free(departures);
+    free(receiver.arrivals);
+    if (sock != NULL) {
+        rudp_close(sock);
+    }
+    rudp_close(receiver.sock);
+
+    if (watchdog.expired) {
+        fprintf(stderr, "Benchmark transfer stuck for %u s (payload %u, loss %.2f%%)\n", deadline, payload, config->loss);
+    } else if (status == -1) {
+        fprintf(stderr, "Benchmark transfer failed (payload %u, loss %.2f%%)\n", payload, config->loss);
+    }
+    return status;
+}
+
+// Receives until the sender closed every connection, counting payload bytes.
+void* runReceiver(void* arg) {
+    struct ReceiverThread* receiver = arg;
+    char data[BUFFER_SIZE];
+
+    double cpuStart = threadCpuSeconds();
+    int receiveResult = 0;
+    for (unsigned int c = 0; c < receiver->connections && receiveResult == 0; c++) {
+        if (rudp_accept(receiver->sock) == 0) {
+            break;
+        }
+        while (1) {
+            receiveResult = rudp_recv(receiver->sock, data, sizeof(data));
+            if (receiveResult > 0) {
+                receiver->bytes += receiveResult;
+
+                // a duplicate keeps the first arrival
+                unsigned int index;
+                memcpy(&index, data + STAMP_OFFSET, sizeof(index));
+                if (receiveResult >= STAMP_OFFSET + STAMP_SIZE && index < receiver->messages && receiver->arrivals[index] == 0) {
+                    receiver->arrivals[index] = nowMicros();
+                }
+            }
+            if (receiveResult == 0 || receiveResult == -1) {
+                break;
+            }
+        }
+    }
+
+    // the ACK of the last FIN may be lost: rudp_accept() answers the sender's retransmissions
+    // until runBench() shuts the socket down
+    if (receiveResult == 0) {
+        receiver->lingering = true;
+        rudp_accept(receiver->sock);
+    }
+    receiver->cpu_s = threadCpuSeconds() - cpuStart;
+    return NULL;
+}
+
+// Waits for the point to finish, shuts its sockets down once the deadline passed.
+void* runWatchdog(void* arg) {
+    struct Watchdog* watchdog = arg;
+
+    while (!watchdog->done && nowMicros() < watchdog->deadline_us) {
+        usleep(10000);
+    }
+    if (!watchdog->done) {
+        watchdog->expired = true;
+        if (watchdog->sender != NULL) {
+            shutdown(watchdog->sender->socket_fd, SHUT_RDWR);
+        }
+        shutdown(watchdog->receiver->socket_fd, SHUT_RDWR);
+    }
+    return NULL;
+}
+
+// Writes the message index into the payload, followed by its complement. Each 16 bit word and its
+// complement add up to 0xFFFF, a zero in the ones' complement sum, so the checksum stays the same.
+void stampMessage(char* data, unsigned int index) {
+    unsigned int complement = ~index;
+    memcpy(data + STAMP_OFFSET, &index, sizeof(index));
+    memcpy(data + STAMP_OFFSET + sizeof(index), &complement, sizeof(complement));
+}
+
+// Relays packets between sender and receiver, applying the configured impairments.
+void* runShim(void* arg) {
+    struct Shim* shim = arg;
+    struct ShimConfig* config = &shim->config;
+    static char buffer[65536];
+
+    while (!shim->stop) {
+
+        // Forward every packet whose time has come, earliest first
+        unsigned long long now = nowMicros();
+        struct timespec timeout = {0, 10 * 1000000};
+        while (shim->queued > 0) {
+            int first = 0;
+            for (int i = 1; i < shim->queued; i++) {
+                if (shim->queue[i].release_us < shim->queue[first].release_us) {
+                    first = i;
+                }
+            }
+            struct ShimPacket* packet = &shim->queue[first];
+            if (packet->release_us > now) {
+                // to the microsecond, delays and jitter below a millisecond stay that short
+                unsigned long long waitUs = packet->release_us - now;
+                timeout.tv_sec = waitUs / 1000000;
+                timeout.tv_nsec = (waitUs % 1000000) * 1000;
+                break;
+            }
+            sendto(packet->out_fd, packet->data, packet->length, 0, (struct sockaddr*) &packet->to, sizeof(packet->to));
+            free(packet->data);
+            *packet = shim->queue[--shim->queued];
+        }
+
+        struct pollfd fds[2] = {{shim->sender_fd, POLLIN, 0}, {shim->receiver_fd, POLLIN, 0}};
+        if (ppoll(fds, 2, &timeout, NULL) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            struct sockaddr_in from;
+            socklen_t fromLen = sizeof(from);
+            ssize_t length = recvfrom(fds[i].fd, buffer, sizeof(buffer), 0, (struct sockaddr*) &from, &fromLen);
+            if (length == -1) {
+                continue;
+            }
+
+            struct sockaddr_in to;
+            int outFd;
+            if (fds[i].fd == shim->sender_fd) {
+                shim->sender_addr = from;
+                to = shim->receiver_addr;
+                outFd = shim->receiver_fd;
+            } else {
+                to = shim->sender_addr;
+                outFd = shim->sender_fd;
+            }
+
+            if (rand_r(&shim->seed) % 10000 < config->loss * 100) {
+                continue;
+            }
+            int copies = rand_r(&shim->seed) % 10000 < config->dup * 100 ? 2 : 1;
+
+            for (int c = 0; c < copies && shim->queued < SHIM_QUEUE_SIZE; c++) {
+                struct ShimPacket* packet = &shim->queue[shim->queued];
+                packet->data = malloc(length);
+                if (packet->data == NULL) {
+                    break;
+                }
+                memcpy(packet->data, buffer, length);
+                packet->length = length;
+                packet->to = to;
+                packet->out_fd = outFd;
+                packet->release_us = nowMicros() + config->delay_us;
+                if (config->jitter_us > 0) {
+                    packet->release_us += rand_r(&shim->seed) % (config->jitter_us + 1);
+                }
+                if (rand_r(&shim->seed) % 10000 < config->reorder * 100) {
+                    packet->release_us += SHIM_REORDER_US;
+                }
+                shim->queued++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Opens a UDP socket bound to an ephemeral loopback port, stores the port if asked.
+int openLoopbackSocket(unsigned short* port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+        getsockname(fd, (struct sockaddr*) &addr, &addrLen) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (port != NULL) {
+        *port = ntohs(addr.sin_port);
+    }
+
+    // The shim is a link, not a bottleneck: give it the room of the RUDP sockets it sits between,
+    // so a whole FEC block sent at once is not dropped by the kernel before the loss model sees it.
+    int bufferSize = RUDP_SOCKET_BUFFER_MAX / 2;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufferSize, sizeof(bufferSize)) == -1) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bufferSize, sizeof(bufferSize)) == -1) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    }
+    return fd;
+}
+
+// Parses a comma separated list of numbers, returns how many were read.
+int parseList(char* list, double* values) {
+    int count = 0;
+    for (char* item = strtok(list, ","); item != NULL && count < MAX_SWEEP; item = strtok(NULL, ",")) {
+        values[count++] = atof(item);
+    }
+    return count;
+}
+
+unsigned long long nowMicros(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (unsigned long long) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+double threadCpuSeconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
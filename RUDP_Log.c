@@ -0,0 +1,185 @@
+#include "RUDP_Log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// One queued message. The queue is a bounded multi-producer ring: a slot at position pos
+// is free for a producer when sequence == pos, and holds a message for the writer when
+// sequence == pos + 1.
+typedef struct RUDPLogEntry{
+    atomic_size_t sequence;
+    int level;
+    char message[RUDP_LOG_MSG_SIZE];
+} RUDP_LogEntry;
+
+atomic_int rudp_log_level = RUDP_LOG_OFF;
+
+static RUDP_LogEntry log_queue[RUDP_LOG_QUEUE_SIZE];
+static atomic_size_t log_head; // next position producers write to
+static size_t log_tail; // next position the writer reads, only used by the writer thread
+static atomic_ulong log_dropped; // messages dropped because the queue was full
+static atomic_bool log_running;
+static FILE* log_out = NULL;
+static pthread_t log_thread;
+static bool log_started = false;
+static pthread_mutex_t log_control = PTHREAD_MUTEX_INITIALIZER; // guards starting and stopping the writer
+
+static const char* level_names[] = {"OFF", "ERROR", "WARN", "INFO", "DEBUG"};
+
+/**
+ * Writes out every message currently in the queue.
+ *
+ * @return true if something was written.
+ */
+static bool log_drain(void){
+    bool wrote = false;
+
+    while(1){
+        RUDP_LogEntry* entry = &log_queue[log_tail & (RUDP_LOG_QUEUE_SIZE - 1)];
+        if(atomic_load_explicit(&entry->sequence, memory_order_acquire) != log_tail + 1){
+            break;
+        }
+        fprintf(log_out, "[RUDP %s] %s\n", level_names[entry->level], entry->message);
+
+        // hand the slot back to the producers for the next lap
+        atomic_store_explicit(&entry->sequence, log_tail + RUDP_LOG_QUEUE_SIZE, memory_order_release);
+        log_tail++;
+        wrote = true;
+    }
+
+    unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if(dropped > 0){
+        fprintf(log_out, "[RUDP WARN] %lu log messages dropped\n", dropped);
+        wrote = true;
+    }
+
+    if(wrote){
+        fflush(log_out);
+    }
+    return wrote;
+}
+
+static void* log_writer(void *arg){
+    (void)arg;
+    struct timespec pause = {0, 1000000};
+
+    while(atomic_load(&log_running)){
+        if(!log_drain()){
+            nanosleep(&pause, NULL);
+        }
+    }
+    log_drain();
+    return NULL;
+}
+
+/**
+ * Sets the runtime log level of the RUDP library.
+ *
+ * @param level One of RUDP_LOG_OFF, RUDP_LOG_ERROR, RUDP_LOG_WARN, RUDP_LOG_INFO, RUDP_LOG_DEBUG.
+ * @param out Stream the writer thread writes to, NULL keeps the current one (stderr by default).
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_log_set_level(int level, FILE *out){
+    if(level < RUDP_LOG_OFF || level > RUDP_LOG_DEBUG){
+        return 0;
+    }
+
+    pthread_mutex_lock(&log_control);
+    if(out != NULL){
+        // the writer may be in the middle of a message, let it finish first
+        atomic_store(&rudp_log_level, RUDP_LOG_OFF);
+        if(log_started){
+            atomic_store(&log_running, false);
+            pthread_join(log_thread, NULL);
+            log_started = false;
+        }
+        log_out = out;
+    }
+
+    if(level > RUDP_LOG_OFF && !log_started){
+        if(log_out == NULL){
+            log_out = stderr;
+        }
+        // a restarted writer continues where the previous one stopped
+        static bool initialized = false;
+        if(!initialized){
+            for(size_t i = 0; i < RUDP_LOG_QUEUE_SIZE; i++){
+                atomic_store(&log_queue[i].sequence, i);
+            }
+            initialized = true;
+        }
+        atomic_store(&log_running, true);
+
+        if(pthread_create(&log_thread, NULL, log_writer, NULL) != 0){
+            pthread_mutex_unlock(&log_control);
+            return 0;
+        }
+
+        static bool registered = false;
+        if(!registered){
+            atexit(rudp_log_shutdown);
+            registered = true;
+        }
+        log_started = true;
+    }
+
+    atomic_store(&rudp_log_level, level);
+    pthread_mutex_unlock(&log_control);
+    return 1;
+}
+
+/**
+ * Queues a message for the writer thread, or drops it if the queue is full.
+ *
+ * @param level Level of the message.
+ * @param format printf style format of the message.
+ */
+void rudp_log_write(int level, const char *format, ...){
+    size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    RUDP_LogEntry* entry;
+
+    while(1){
+        entry = &log_queue[pos & (RUDP_LOG_QUEUE_SIZE - 1)];
+        intptr_t diff = (intptr_t)atomic_load_explicit(&entry->sequence, memory_order_acquire) - (intptr_t)pos;
+
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }
+        else if(diff < 0){
+            // the writer has not caught up, never block the caller
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else{
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    entry->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->message, RUDP_LOG_MSG_SIZE, format, args);
+    va_end(args);
+
+    atomic_store_explicit(&entry->sequence, pos + 1, memory_order_release);
+}
+
+/**
+ * Writes out every queued message and stops the writer thread.
+ */
+void rudp_log_shutdown(void){
+    pthread_mutex_lock(&log_control);
+    atomic_store(&rudp_log_level, RUDP_LOG_OFF);
+    if(log_started){
+        atomic_store(&log_running, false);
+        pthread_join(log_thread, NULL);
+        log_started = false;
+    }
+    pthread_mutex_unlock(&log_control);
+}
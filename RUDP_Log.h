@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define RUDP_LOG_OFF 0
+#define RUDP_LOG_ERROR 1
+#define RUDP_LOG_WARN 2
+#define RUDP_LOG_INFO 3
+#define RUDP_LOG_DEBUG 4
+
+// Messages above this level are compiled out, e.g. build with -DRUDP_LOG_COMPILE_LEVEL=RUDP_LOG_ERROR
+#ifndef RUDP_LOG_COMPILE_LEVEL
+#define RUDP_LOG_COMPILE_LEVEL RUDP_LOG_DEBUG
+#endif
+
+#define RUDP_LOG_QUEUE_SIZE 1024 // messages waiting for the writer thread, must be a power of 2
+#define RUDP_LOG_MSG_SIZE 128 // longer messages are truncated
+
+// Current runtime level, RUDP_LOG_OFF until rudp_log_set_level() is called.
+extern atomic_int rudp_log_level;
+
+/**
+ * Logs a printf style message if level is enabled at compile time and at runtime.
+ * The message is formatted by the caller and queued, a background thread writes it out.
+ * When the queue is full the message is dropped instead of blocking the caller.
+ */
+#define RUDP_LOG(level, ...) \
+    do{ \
+        if((level) <= RUDP_LOG_COMPILE_LEVEL && \
+           (level) <= atomic_load_explicit(&rudp_log_level, memory_order_relaxed)){ \
+            rudp_log_write((level), __VA_ARGS__); \
+        } \
+    }while(0)
+
+#define rudp_log_error(...) RUDP_LOG(RUDP_LOG_ERROR, __VA_ARGS__)
+#define rudp_log_warn(...) RUDP_LOG(RUDP_LOG_WARN, __VA_ARGS__)
+#define rudp_log_info(...) RUDP_LOG(RUDP_LOG_INFO, __VA_ARGS__)
+#define rudp_log_debug(...) RUDP_LOG(RUDP_LOG_DEBUG, __VA_ARGS__)
+
+/**
+ * Sets the runtime log level of the RUDP library. The library is silent until this is called.
+ * The first call with a level above RUDP_LOG_OFF starts the writer thread, which drains
+ * the queue to out and is stopped at exit.
+ *
+ * @param level One of RUDP_LOG_OFF, RUDP_LOG_ERROR, RUDP_LOG_WARN, RUDP_LOG_INFO, RUDP_LOG_DEBUG.
+ * @param out Stream the writer thread writes to, NULL keeps the current one (stderr by default).
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_log_set_level(int level, FILE *out);
+
+/**
+ * Queues a message for the writer thread. Use the RUDP_LOG macros instead, they skip
+ * disabled levels without formatting the message.
+ */
+void rudp_log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Writes out every queued message and stops the writer thread.
+ */
+void rudp_log_shutdown(void);
@@ -1,7 +1,7 @@
 #include "RUDP.h"
 #include <stdio.h>
 
-#define MAX_RUNS 50
+#define INITIAL_RUNS 16
 
 
 
@@ -12,7 +12,7 @@ struct RunStatistics {
 };
 
 void printStatistics(struct RunStatistics* statistics, int numRuns);
-void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStatistics, int numRuns);
+void calcTime(int fileSize, struct timeval start, struct RunStatistics** runStatistics, int* maxRuns, int numRuns);
 
 int main(int argc,char** argv) {
 
@@ -23,13 +23,20 @@ int main(int argc,char** argv) {
     }
 
     // time statistics variables
-    struct RunStatistics runStatistics[MAX_RUNS];
+    int maxRuns = INITIAL_RUNS;
+    struct RunStatistics* runStatistics = malloc(maxRuns * sizeof(struct RunStatistics));
     int numRuns = 0;
+    if(runStatistics == NULL){
+        return -1;
+    }
     struct timeval start;
 
     // Parse command line arguments
     unsigned short int port = atoi(argv[2]);
 
+    // Show library errors, the RUDP library is silent otherwise
+    rudp_log_set_level(RUDP_LOG_ERROR, stderr);
+
     RUDP_Socket* sock = rudp_socket(true, port);
     if(sock == NULL){
         return -1;
@@ -82,7 +89,7 @@ int main(int argc,char** argv) {
                 printf("Ack sent\n");
 
                 // data sent. calc the time it took
-                calcTime(totalReceived, start, runStatistics, numRuns);
+                calcTime(totalReceived, start, &runStatistics, &maxRuns, numRuns);
                 numRuns++;
 
                 break;
@@ -134,9 +141,14 @@ int main(int argc,char** argv) {
     // Calculate and print averages
     printStatistics(runStatistics, numRuns);
 
+    // Connection counters
+    printf("- Connection: ");
+    rudp_print_stats(sock, stdout);
+
     printf("----------------------------------\n");
 
     // Exit and close connections
+    free(runStatistics);
     rudp_close(sock);
     return 0;
 }
@@ -158,8 +170,8 @@ void printStatistics(struct RunStatistics* statistics, int numRuns) {
     printf("- Average bandwidth: %.2fMB/s\n", avgSpeed);
 }
 
-// Function to calculate time and speed for a run
-void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStatistics, int numRuns) {
+// Function to calculate time and speed for a run, grows the statistics array when it is full
+void calcTime(int fileSize, struct timeval start, struct RunStatistics** runStatistics, int* maxRuns, int numRuns) {
     struct timeval end;
     gettimeofday(&end, NULL);
     double elapsedTime = (end.tv_sec - start.tv_sec) * 1000.0;  // Convert to milliseconds
@@ -167,6 +179,16 @@ void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStati
 
     double speed = (fileSize / elapsedTime) * 1000.0 / (1024 * 1024);  // Speed in MB/s
 
-    runStatistics[numRuns].time = elapsedTime;
-    runStatistics[numRuns].speed = speed;
+    if (numRuns == *maxRuns) {
+        struct RunStatistics* grown = realloc(*runStatistics, 2 * (*maxRuns) * sizeof(struct RunStatistics));
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *runStatistics = grown;
+        *maxRuns *= 2;
+    }
+
+    (*runStatistics)[numRuns].time = elapsedTime;
+    (*runStatistics)[numRuns].speed = speed;
 }
\ No newline at end of file
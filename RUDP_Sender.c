@@ -1,8 +1,10 @@
 #include "RUDP.h"
+#include <fcntl.h>
+#include <sys/stat.h>
 
 
-// Function to read content from a file and return it along with its size
-void readFromFile(char** file_contant, int* size);
+// Function to start reading a file, its content is ready once rudp_read_wait() returns. Returns the file descriptor
+int readFromFile(RUDP_Socket* sock, char** file_contant, int* size);
 
 // Global variables
 char *fileName = "tosend.txt";
@@ -10,14 +12,18 @@ char *fileName = "tosend.txt";
 int main(int argc,char** argv) {
 
      // Check command line arguments
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s -IP <receiver_ip> -P <receiver_port> \n", argv[0]);
+    if ((argc != 5 && argc != 7) || (argc == 7 && strcmp(argv[5], "-fec") != 0)) {
+        fprintf(stderr, "Usage: %s -IP <receiver_ip> -P <receiver_port> [-fec <block_size>]\n", argv[0]);
         exit(1);
     }
 
     // Parse command line arguments
     unsigned short int port = atoi(argv[4]);
     char *receiver_ip = argv[2];
+    unsigned int fecBlockSize = argc == 7 ? atoi(argv[6]) : 0;
+
+    // Show library errors, the RUDP library is silent otherwise
+    rudp_log_set_level(RUDP_LOG_ERROR, stderr);
 
     // File-related variables
     char *fileContent = NULL;
@@ -29,18 +35,37 @@ int main(int argc,char** argv) {
         return -1;
     }
 
+    if(fecBlockSize > 0 && rudp_set_fec(sock, fecBlockSize) == 0){
+        printf("Invalid FEC block size, must be 1 to %d\n", RUDP_FEC_MAX_K);
+        rudp_close(sock);
+        return -1;
+    }
+
+    // start reading the file, with the io_uring engine the disk works during the handshake
+    int fileFd = readFromFile(sock, &fileContent, &fileSize);
+
     printf("Sending connect message to receiver\n");
 
     if(rudp_connect(sock, receiver_ip, port) == 0){
         printf("Connction to Receiver Failed\n");
         rudp_close(sock);
+        close(fileFd);
+        free(fileContent);
         return -1;
     }
 
     printf("got ACK connection successful, sending file\n");
 
-    // read the file
-    readFromFile(&fileContent, &fileSize);
+    // wait for the file
+    int bytesRead = rudp_read_wait(sock);
+    close(fileFd);
+    if(bytesRead != fileSize){
+        printf("Reading the file failed\n");
+        rudp_close(sock);
+        free(fileContent);
+        return -1;
+    }
+    printf("File \"%s\" total size is %d bytes.\n", fileName, fileSize);
 
     //Send the file to the receiver
     int userChoice = 1;
@@ -50,7 +75,7 @@ int main(int argc,char** argv) {
 
         // Send data in chunks
         RUDPPacket DATA_packet;
-        memset(DATA_packet.data,0,BUFFER_SIZE);
+        memset(&DATA_packet,0,sizeof(DATA_packet));
         DATA_packet.header.flags = RUDP_DATA;
         int i;
         for(i=0;i+BUFFER_SIZE<fileSize;i+=BUFFER_SIZE) {
@@ -85,6 +110,13 @@ int main(int argc,char** argv) {
             return -1;
         }
 
+        // make sure the last FEC block reached the receiver
+        if(rudp_flush(sock) == 0){
+            rudp_close(sock);
+            free(fileContent);
+            return -1;
+        }
+
         // waiting for user descision
         printf("Resend the file? 1 for resend, 0 for exit \n");
         scanf("%d",&userChoice);
@@ -118,31 +150,36 @@ int main(int argc,char** argv) {
 
     free(fileContent);
 
+    printf("Connection stats: ");
+    rudp_print_stats(sock, stdout);
+
     //Close the connection and exit 
     rudp_close(sock);
     return 0;
 }
 
 
-void readFromFile(char** file_content, int* size) {
-    FILE *fpointer = NULL;
-
-    fpointer = fopen(fileName, "r");
+int readFromFile(RUDP_Socket* sock, char** file_content, int* size) {
+    int fd = open(fileName, O_RDONLY);
 
-    if (fpointer == NULL) {
-        perror("fopen");
+    if (fd == -1) {
+        perror("open");
         exit(1);
     }
 
     // Find the file size and allocate enough memory for it.
-    fseek(fpointer, 0L, SEEK_END);
-    *size = (int) ftell(fpointer);
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    *size = (int) fileStat.st_size;
     *file_content = (char*) malloc(*size * sizeof(char));
-    fseek(fpointer, 0L, SEEK_SET);
-
-    fread(*file_content, sizeof(char), *size, fpointer);
-    fclose(fpointer);
-
-    printf("File \"%s\" total size is %d bytes.\n", fileName, *size);
 
+    // The read goes on through the socket, on its io_uring engine if it has one
+    if (rudp_read_file(sock, fd, *file_content, *size, 0) == 0) {
+        printf("Reading the file failed\n");
+        exit(1);
+    }
+    return fd;
 }
@@ -0,0 +1,453 @@
+#define _GNU_SOURCE // POLLRDHUP
+#include "RUDP_Uring.h"
+
+#ifdef RUDP_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Space for the recvmsg() header, the source address and the largest UDP datagram.
+#define RUDP_URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + 65536)
+
+static int uring_enter(RUDP_Uring *ring, unsigned int wait){
+    int result;
+    do{
+        result = syscall(__NR_io_uring_enter, ring->fd, ring->sq_queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }while(result == -1 && errno == EINTR);
+
+    if(result == -1){
+        return -1;
+    }
+    ring->sq_queued -= result;
+    return 0;
+}
+
+// Like uring_enter() waiting for one completion, but for timeout_ms at most. A timeout is not an error.
+static int uring_wait(RUDP_Uring *ring, unsigned int timeout_ms){
+    struct __kernel_timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&timeout;
+
+    int result;
+    do{
+        result = syscall(__NR_io_uring_enter, ring->fd, ring->sq_queued, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }while(result == -1 && errno == EINTR);
+
+    if(result == -1){
+        return errno == ETIME ? 0 : -1;
+    }
+    ring->sq_queued -= result;
+    return 0;
+}
+
+// True once the socket was shut down for reading, then poll() reports a hang up.
+static bool uring_shut_down(int fd){
+    struct pollfd pfd = {fd, POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP));
+}
+
+// Returns the next free submission entry, cleared, or NULL if an error occurs.
+static struct io_uring_sqe* uring_sqe(RUDP_Uring *ring){
+    unsigned int tail = *ring->sq_tail;
+
+    // a full queue goes to the kernel first
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask && uring_enter(ring, 0) == -1){
+        return NULL;
+    }
+
+    unsigned int index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[index];
+}
+
+// Makes the entry returned by uring_sqe() visible to the kernel. It is submitted by the next uring_enter().
+static void uring_queue(RUDP_Uring *ring){
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->sq_queued++;
+}
+
+// Returns the oldest completion, or NULL if there is none yet.
+static struct io_uring_cqe* uring_peek(RUDP_Uring *ring){
+    unsigned int head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+// Hands the completion returned by uring_peek() back to the kernel.
+static void uring_seen(RUDP_Uring *ring){
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Takes the result of a send or file read completion.
+static void uring_complete(RUDP_Uring *ring, const struct io_uring_cqe *cqe){
+    if(cqe->user_data == RUDP_URING_SEND){
+        ring->sends_pending--;
+        if(cqe->res < 0){
+            if(ring->send_error == 0){
+                ring->send_error = -cqe->res;
+            }
+        }
+        else{
+            ring->sent_packets++;
+            ring->sent_bytes += cqe->res;
+        }
+    }
+    else if(cqe->user_data == RUDP_URING_READ){
+        ring->read_pending = false;
+        ring->read_result = cqe->res;
+    }
+}
+
+// Gives a receive buffer back to the kernel.
+static void uring_recycle(RUDP_Uring *ring, unsigned short id){
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (RUDP_URING_BUFFERS - 1)];
+    buf->addr = (unsigned long)(ring->buffers + (size_t)id * ring->buffer_size);
+    buf->len = ring->buffer_size;
+    buf->bid = id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sets up a ring.
+ *
+ * @param ring Ring to set up.
+ * @param receive True to also set up the provided buffer ring for rudp_uring_recvfrom().
+ * @return 1 on success, 0 if the kernel does not support what is needed.
+ */
+int rudp_uring_init(RUDP_Uring *ring, bool receive){
+    memset(ring, 0, sizeof(RUDP_Uring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // completions wait for our next io_uring_enter(), instead of interrupting a blocking
+    // recvfrom() of the same thread with EINTR
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, RUDP_URING_ENTRIES, &params);
+    if(ring->fd == -1){
+        return 0;
+    }
+
+    // both queues in one mapping, every kernel since 5.4. Waits with a timeout since 5.11
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)){
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(cq_size > ring->sq_ring_size){
+        ring->sq_ring_size = cq_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED){
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED){
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return 0;
+    }
+
+    char* base = (char*)ring->sq_ring;
+    ring->sq_head = (unsigned int*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(base + params.sq_off.array);
+    ring->cq_head = (unsigned int*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    if(!receive){
+        return 1;
+    }
+
+    // the kernel picks a buffer from this ring for each datagram, so a single request receives them all
+    ring->buffer_size = RUDP_URING_BUFFER_SIZE;
+    ring->buffers = (char*)malloc((size_t)RUDP_URING_BUFFERS * ring->buffer_size);
+    ring->buf_ring = mmap(NULL, RUDP_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffers == NULL || ring->buf_ring == MAP_FAILED){
+        if(ring->buf_ring == MAP_FAILED){
+            ring->buf_ring = NULL;
+        }
+        rudp_uring_exit(ring);
+        return 0;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = RUDP_URING_BUFFERS;
+    reg.bgid = RUDP_URING_GROUP;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+        rudp_uring_exit(ring);
+        return 0;
+    }
+    for(unsigned short id = 0; id < RUDP_URING_BUFFERS; id++){
+        uring_recycle(ring, id);
+    }
+
+    // received messages carry the source address and no control data
+    ring->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    return 1;
+}
+
+/**
+ * Tears down a ring, cancelling the requests still in flight.
+ *
+ * @param ring Ring set up by rudp_uring_init().
+ */
+void rudp_uring_exit(RUDP_Uring *ring){
+    close(ring->fd);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->buf_ring != NULL){
+        munmap(ring->buf_ring, RUDP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    free(ring->buffers);
+}
+
+/**
+ * Queues a datagram send. It goes to the kernel with the next submission, the buffer
+ * must stay unchanged until rudp_uring_wait_sends() returns.
+ *
+ * @param ring The ring.
+ * @param fd Socket to send on.
+ * @param buffer Datagram to send.
+ * @param length Size of the datagram.
+ * @param addr Destination, must stay valid until the send completes.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_uring_sendto(RUDP_Uring *ring, int fd, const void *buffer, size_t length, const struct sockaddr_in *addr){
+    if(ring->send_next == RUDP_URING_ENTRIES && rudp_uring_wait_sends(ring) == -1){
+        return 0;
+    }
+
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    if(sqe == NULL){
+        return 0;
+    }
+
+    struct iovec* iov = &ring->send_iovs[ring->send_next];
+    struct msghdr* msg = &ring->send_msgs[ring->send_next];
+    ring->send_next++;
+
+    iov->iov_base = (void*)buffer;
+    iov->iov_len = length;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = (void*)addr;
+    msg->msg_namelen = sizeof(struct sockaddr_in);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)msg;
+    sqe->len = 1;
+    sqe->user_data = RUDP_URING_SEND;
+    uring_queue(ring);
+    ring->sends_pending++;
+    return 1;
+}
+
+/**
+ * Submits the queued requests and waits until every send completed, in a single system call
+ * when the sends complete right away. The completed sends are added to sent_packets and sent_bytes.
+ *
+ * @param ring The ring.
+ * @return 0 on success, -1 with errno set if a send failed.
+ */
+int rudp_uring_wait_sends(RUDP_Uring *ring){
+    while(ring->sends_pending > 0){
+        struct io_uring_cqe* cqe = uring_peek(ring);
+        if(cqe == NULL){
+            if(uring_enter(ring, 1) == -1){
+                return -1;
+            }
+            continue;
+        }
+        uring_complete(ring, cqe);
+        uring_seen(ring);
+    }
+    ring->send_next = 0;
+
+    if(ring->send_error != 0){
+        errno = ring->send_error;
+        ring->send_error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receives a datagram through the multishot receive, entering the kernel only when no
+ * datagram is waiting in the completion queue. Like recvfrom(), a longer datagram is truncated.
+ *
+ * @param ring Ring set up to receive.
+ * @param fd Socket to receive on.
+ * @param buffer Where to store the datagram.
+ * @param length Size of buffer.
+ * @param addr Filled with the source address.
+ * @return Size of the datagram stored, -1 with errno set if an error occurs.
+ */
+int rudp_uring_recvfrom(RUDP_Uring *ring, int fd, void *buffer, size_t length, struct sockaddr_in *addr){
+    while(1){
+        // one request keeps receiving until it fails or runs out of buffers
+        if(!ring->recv_armed){
+            struct io_uring_sqe* sqe = uring_sqe(ring);
+            if(sqe == NULL){
+                return -1;
+            }
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)&ring->recv_msg;
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = RUDP_URING_GROUP;
+            sqe->user_data = RUDP_URING_RECV;
+            uring_queue(ring);
+            ring->recv_armed = true;
+        }
+
+        struct io_uring_cqe* cqe = uring_peek(ring);
+        if(cqe == NULL){
+            if(uring_wait(ring, RUDP_URING_WAKE_MS) == -1){
+                return -1;
+            }
+            if(uring_peek(ring) == NULL && uring_shut_down(fd)){
+                // the receive would wait forever, take it off the socket
+                struct io_uring_sqe* sqe = uring_sqe(ring);
+                if(sqe != NULL){
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = RUDP_URING_RECV;
+                    sqe->user_data = RUDP_URING_CANCEL;
+                    uring_queue(ring);
+                    uring_enter(ring, 0);
+                }
+                errno = ESHUTDOWN;
+                return -1;
+            }
+            continue;
+        }
+        struct io_uring_cqe done = *cqe;
+        uring_seen(ring);
+
+        if(done.user_data != RUDP_URING_RECV){
+            uring_complete(ring, &done);
+            continue;
+        }
+        if(!(done.flags & IORING_CQE_F_MORE)){
+            ring->recv_armed = false;
+        }
+        if(done.res < 0){
+            // every buffer was taken, they are all back by now
+            if(done.res == -ENOBUFS){
+                continue;
+            }
+            errno = -done.res;
+            return -1;
+        }
+
+        unsigned short id = done.flags >> IORING_CQE_BUFFER_SHIFT;
+        struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)(ring->buffers + (size_t)id * ring->buffer_size);
+        char* name = (char*)(out + 1);
+        char* payload = name + ring->recv_msg.msg_namelen + ring->recv_msg.msg_controllen;
+
+        size_t num_bytes = out->payloadlen < length ? out->payloadlen : length;
+        memcpy(buffer, payload, num_bytes);
+        if(addr != NULL){
+            memcpy(addr, name, sizeof(struct sockaddr_in));
+        }
+        uring_recycle(ring, id);
+        return (int)num_bytes;
+    }
+}
+
+/**
+ * Counts the completions waiting on the ring.
+ *
+ * @param ring The ring.
+ * @return Number of completions waiting.
+ */
+unsigned int rudp_uring_ready(RUDP_Uring *ring){
+    return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+/**
+ * Submits a file read. Only one read may be pending.
+ *
+ * @param ring The ring.
+ * @param fd File to read.
+ * @param buffer Where to store the data, must stay valid until rudp_uring_wait_read() returns.
+ * @param length Bytes to read.
+ * @param offset Position in the file.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_uring_read(RUDP_Uring *ring, int fd, void *buffer, unsigned int length, unsigned long long offset){
+    if(ring->read_pending){
+        return 0;
+    }
+
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    if(sqe == NULL){
+        return 0;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = RUDP_URING_READ;
+    uring_queue(ring);
+    ring->read_pending = true;
+
+    // start the disk now, the caller goes on with the network meanwhile.
+    // If the kernel is busy the read goes with the next submission instead.
+    uring_enter(ring, 0);
+    return 1;
+}
+
+/**
+ * Waits until the pending file read completed.
+ *
+ * @param ring The ring.
+ * @return Number of bytes read, -1 with errno set if an error occurs.
+ */
+int rudp_uring_wait_read(RUDP_Uring *ring){
+    while(ring->read_pending){
+        struct io_uring_cqe* cqe = uring_peek(ring);
+        if(cqe == NULL){
+            if(uring_enter(ring, 1) == -1){
+                return -1;
+            }
+            continue;
+        }
+        uring_complete(ring, cqe);
+        uring_seen(ring);
+    }
+
+    if(ring->read_result < 0){
+        errno = -ring->read_result;
+        return -1;
+    }
+    return ring->read_result;
+}
+
+#endif
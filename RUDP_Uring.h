@@ -0,0 +1,150 @@
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// The io_uring engine is only built with -DRUDP_IO_URING (make uring), otherwise every
+// packet and file read is a blocking system call of its own.
+#ifdef RUDP_IO_URING
+
+#include <linux/io_uring.h>
+
+#define RUDP_URING_ENTRIES 32 // submission queue size, holds a full FEC block and its retransmissions
+#define RUDP_URING_BUFFERS 16 // receive buffers the kernel picks from, must be a power of 2
+#define RUDP_URING_GROUP 0 // id of the provided buffer group
+#define RUDP_URING_WAKE_MS 50 // a waiting receive wakes up this often to notice a shutdown() of its socket
+
+// user_data of the requests, tells the completions apart
+#define RUDP_URING_SEND 1
+#define RUDP_URING_RECV 2
+#define RUDP_URING_READ 3
+#define RUDP_URING_CANCEL 4
+
+// A ring shared by the socket and file I/O of an RUDP socket. It is used by the thread using
+// the socket only, so there is no locking. A ring that receives is used for nothing else:
+// only rudp_uring_recvfrom() knows what to do with the datagrams completing on it.
+typedef struct RUDPUring{
+    int fd; // io_uring file descriptor
+
+    // submission queue, mapped from the kernel
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned int sq_queued; // requests filled in but not given to the kernel yet
+
+    // completion queue, in the same mapping as the submission queue
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // sendmsg() arguments, valid until the send completes. They are used in order and
+    // reused only once every send completed.
+    struct msghdr send_msgs[RUDP_URING_ENTRIES];
+    struct iovec send_iovs[RUDP_URING_ENTRIES];
+    unsigned int send_next; // next free sendmsg() arguments
+    unsigned int sends_pending; // sends given to the kernel or queued, not completed yet
+    int send_error; // first error of the pending sends, 0 if none
+    unsigned int sent_packets; // completed sends not yet counted by the caller
+    unsigned long long sent_bytes;
+
+    // multishot recvmsg() with buffers the kernel picks from the provided buffer ring
+    struct io_uring_buf_ring* buf_ring; // NULL if the ring does not receive
+    char* buffers;
+    unsigned int buffer_size;
+    unsigned short buf_tail; // buffers handed to the kernel so far, wraps around
+    struct msghdr recv_msg; // layout of the received messages: name length, no control data
+    bool recv_armed; // the multishot receive is in place
+
+    // file read
+    bool read_pending;
+    int read_result;
+} RUDP_Uring;
+
+/**
+ * Sets up a ring.
+ *
+ * @param ring Ring to set up.
+ * @param receive True to also set up the provided buffer ring for rudp_uring_recvfrom().
+ * @return 1 on success, 0 if the kernel does not support what is needed.
+ */
+int rudp_uring_init(RUDP_Uring *ring, bool receive);
+
+/**
+ * Tears down a ring, cancelling the requests still in flight.
+ *
+ * @param ring Ring set up by rudp_uring_init().
+ */
+void rudp_uring_exit(RUDP_Uring *ring);
+
+/**
+ * Queues a datagram send. It goes to the kernel with the next submission, the buffer
+ * must stay unchanged until rudp_uring_wait_sends() returns.
+ *
+ * @param ring The ring.
+ * @param fd Socket to send on.
+ * @param buffer Datagram to send.
+ * @param length Size of the datagram.
+ * @param addr Destination, must stay valid until the send completes.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_uring_sendto(RUDP_Uring *ring, int fd, const void *buffer, size_t length, const struct sockaddr_in *addr);
+
+/**
+ * Submits the queued requests and waits until every send completed, in a single system call
+ * when the sends complete right away. The completed sends are added to sent_packets and sent_bytes.
+ *
+ * @param ring The ring.
+ * @return 0 on success, -1 with errno set if a send failed.
+ */
+int rudp_uring_wait_sends(RUDP_Uring *ring);
+
+/**
+ * Receives a datagram through the multishot receive, entering the kernel only when no
+ * datagram is waiting in the completion queue. Like recvfrom(), a longer datagram is truncated.
+ * A shutdown() of the socket by another thread does not end the multishot receive, so the wait
+ * wakes up every RUDP_URING_WAKE_MS to look for one, and cancels the receive when it finds it.
+ *
+ * @param ring Ring set up to receive.
+ * @param fd Socket to receive on.
+ * @param buffer Where to store the datagram.
+ * @param length Size of buffer.
+ * @param addr Filled with the source address.
+ * @return Size of the datagram stored, -1 with errno set if an error occurs (ESHUTDOWN once the socket was shut down).
+ */
+int rudp_uring_recvfrom(RUDP_Uring *ring, int fd, void *buffer, size_t length, struct sockaddr_in *addr);
+
+/**
+ * Counts the completions waiting on the ring. On a receiving ring, these are the datagrams
+ * already taken out of the socket but not handed out by rudp_uring_recvfrom() yet.
+ *
+ * @param ring The ring.
+ * @return Number of completions waiting.
+ */
+unsigned int rudp_uring_ready(RUDP_Uring *ring);
+
+/**
+ * Submits a file read. Only one read may be pending.
+ *
+ * @param ring The ring.
+ * @param fd File to read.
+ * @param buffer Where to store the data, must stay valid until rudp_uring_wait_read() returns.
+ * @param length Bytes to read.
+ * @param offset Position in the file.
+ * @return 1 on success, 0 if an error occurs.
+ */
+int rudp_uring_read(RUDP_Uring *ring, int fd, void *buffer, unsigned int length, unsigned long long offset);
+
+/**
+ * Waits until the pending file read completed.
+ *
+ * @param ring The ring.
+ * @return Number of bytes read, -1 with errno set if an error occurs.
+ */
+int rudp_uring_wait_read(RUDP_Uring *ring);
+
+#endif